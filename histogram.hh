@@ -0,0 +1,139 @@
+// -*- mode: c++ -*-
+#ifndef PEQUOD_HISTOGRAM_HH
+#define PEQUOD_HISTOGRAM_HH
+#include "compiler.hh"
+#include <stdint.h>
+#include <string.h>
+
+/** @class latency_histogram
+    @brief Fixed-memory log-linear histogram of nonnegative integer values.
+
+    Values below 64 are recorded exactly. Above that, each power-of-two
+    range is split into 32 equal buckets, so any reported value is within
+    about 3% of a value that was recorded. Values of 2<sup>40</sup> or
+    more (about 18 minutes, in nanoseconds) share the top bucket, whose
+    percentiles report max(). */
+class latency_histogram {
+  public:
+    enum { sub_bits = 6, nsub = 1 << sub_bits, max_bits = 40,
+           nbuckets = nsub + (max_bits - sub_bits) * (nsub / 2) };
+
+    inline latency_histogram();
+
+    inline void record(uint64_t v);
+    inline void merge(const latency_histogram& x);
+    inline void clear();
+
+    inline uint64_t count() const;
+    inline uint64_t min() const;
+    inline uint64_t max() const;
+    inline double mean() const;
+    inline uint64_t percentile(double p) const;
+
+  private:
+    uint64_t counts_[nbuckets];
+    uint64_t count_;
+    uint64_t min_;
+    uint64_t max_;
+    uint64_t sum_;
+
+    static inline int bucket(uint64_t v);
+    static inline uint64_t bucket_low(int b);
+    static inline uint64_t bucket_high(int b);
+};
+
+inline latency_histogram::latency_histogram() {
+    clear();
+}
+
+inline int latency_histogram::bucket(uint64_t v) {
+    if (v < uint64_t(nsub))
+        return v;
+    int m = 64 - ffs_msb((unsigned long long) v);
+    if (m >= max_bits)
+        return nbuckets - 1;
+    int shift = m - sub_bits + 1;
+    return nsub + (m - sub_bits) * (nsub / 2) + int(v >> shift) - nsub / 2;
+}
+
+inline uint64_t latency_histogram::bucket_low(int b) {
+    if (b < nsub)
+        return b;
+    int m = (b - nsub) / (nsub / 2) + sub_bits;
+    int shift = m - sub_bits + 1;
+    return uint64_t((b - nsub) % (nsub / 2) + nsub / 2) << shift;
+}
+
+inline uint64_t latency_histogram::bucket_high(int b) {
+    if (b < nsub)
+        return b;
+    else if (b == nbuckets - 1)
+        return uint64_t(-1);
+    int m = (b - nsub) / (nsub / 2) + sub_bits;
+    return bucket_low(b) + (uint64_t(1) << (m - sub_bits + 1)) - 1;
+}
+
+inline void latency_histogram::record(uint64_t v) {
+    ++counts_[bucket(v)];
+    if (count_ == 0 || v < min_)
+        min_ = v;
+    if (v > max_)
+        max_ = v;
+    ++count_;
+    sum_ += v;
+}
+
+inline void latency_histogram::merge(const latency_histogram& x) {
+    if (!x.count_)
+        return;
+    for (int b = 0; b != nbuckets; ++b)
+        counts_[b] += x.counts_[b];
+    if (count_ == 0 || x.min_ < min_)
+        min_ = x.min_;
+    if (x.max_ > max_)
+        max_ = x.max_;
+    count_ += x.count_;
+    sum_ += x.sum_;
+}
+
+inline void latency_histogram::clear() {
+    memset(counts_, 0, sizeof(counts_));
+    count_ = min_ = max_ = sum_ = 0;
+}
+
+inline uint64_t latency_histogram::count() const {
+    return count_;
+}
+
+inline uint64_t latency_histogram::min() const {
+    return min_;
+}
+
+inline uint64_t latency_histogram::max() const {
+    return max_;
+}
+
+inline double latency_histogram::mean() const {
+    return count_ ? sum_ / (double) count_ : 0;
+}
+
+/** @brief Return the value at quantile @a p, where 0 <= @a p <= 1.
+
+    The result is the upper bound of the bucket holding the quantile,
+    clamped to the recorded min() and max(). */
+inline uint64_t latency_histogram::percentile(double p) const {
+    if (!count_)
+        return 0;
+    uint64_t rank = uint64_t(p * count_ + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b != nbuckets; ++b)
+        if ((seen += counts_[b]) >= rank) {
+            uint64_t v = bucket_high(b);
+            return v < min_ ? min_ : (v > max_ ? max_ : v);
+        }
+    return max_;
+}
+
+#endif
@@ -17,6 +17,7 @@
 #include "json.hh"
 #include "compiler.hh"
 #include <ctype.h>
+#include <new>
 
 /** @class Json
     @brief Json data.
@@ -59,19 +60,198 @@ const Json Json::null_json;
 static const String array_string("[Array]", 7);
 static const String object_string("[Object]", 8);
 
+// Allocation internals
+
+// Array and object storage is carved from per-thread size classes spaced
+// every 64 bytes up to 2KB. Each block starts with a header naming its size
+// class, or the arena chunk it came from. Freed blocks are cached on their
+// class's free list, so steady-state parsing and building rarely reaches
+// malloc. Blocks may be freed by a thread other than their allocator; they
+// simply join that thread's lists.
+
+namespace {
+struct json_block {
+    void* chunk;                // owning arena chunk, or free-list link
+    size_t klass;               // size class, 0 if oversized
+};
+
+enum {
+    json_granule = 64, json_nclass = 32, json_max_cached_bytes = 1 << 20
+};
+
+struct json_pool {
+    json_block* free[json_nclass + 1];
+    size_t cached_bytes;
+    Json::arena* arena;
+    bool dead;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t reuses;
+    uint64_t mallocs;
+    uint64_t arena_allocations;
+};
+
+__thread json_pool pool;
+
+// Returns cached blocks at thread exit. The pool itself is trivially
+// destructible so that Json values destroyed later still find it.
+struct json_pool_reaper {
+    json_pool_reaper() {
+    }
+    ~json_pool_reaper() {
+        for (int k = 1; k <= json_nclass; ++k)
+            while (json_block* b = pool.free[k]) {
+                pool.free[k] = static_cast<json_block*>(b->chunk);
+                free(b);
+            }
+        pool.cached_bytes = 0;
+        pool.dead = true;
+    }
+    void touch() {
+    }
+};
+
+thread_local json_pool_reaper pool_reaper;
+}
+
+struct Json::arena::chunk {
+    bool retired;
+    size_t live;
+};
+
+void* Json::allocate(size_t size) {
+    json_pool& p = pool;
+    ++p.allocations;
+    size += sizeof(json_block);
+    json_block* b;
+    if (p.arena && (b = static_cast<json_block*>(p.arena->allocate(size)))) {
+        ++p.arena_allocations;
+        return b + 1;
+    }
+    size_t k = (size + json_granule - 1) / json_granule;
+    if (k <= json_nclass && (b = p.free[k])) {
+        p.free[k] = static_cast<json_block*>(b->chunk);
+        p.cached_bytes -= k * json_granule;
+        ++p.reuses;
+    } else {
+        if (k > json_nclass)
+            k = 0;
+        b = static_cast<json_block*>(malloc(k ? k * json_granule : size));
+        if (!b)
+            throw std::bad_alloc();
+        b->klass = k;
+        ++p.mallocs;
+        pool_reaper.touch();
+    }
+    b->chunk = 0;
+    return b + 1;
+}
+
+void Json::deallocate(void* ptr) {
+    if (!ptr)
+        return;
+    json_pool& p = pool;
+    json_block* b = static_cast<json_block*>(ptr) - 1;
+    ++p.frees;
+    size_t k = b->klass;
+    if (b->chunk)
+        arena::release(static_cast<arena::chunk*>(b->chunk));
+    else if (k && !p.dead
+             && p.cached_bytes + k * json_granule <= json_max_cached_bytes) {
+        b->chunk = p.free[k];
+        p.free[k] = b;
+        p.cached_bytes += k * json_granule;
+    } else
+        free(b);
+}
+
+/** @brief Return the calling thread's Json allocation counters.
+
+    The result is an object with members "allocations" and "frees" (array
+    and object storage blocks), "reuses" (allocations served from the
+    per-thread free lists), "mallocs" (allocations that reached malloc),
+    "arena_allocations", and "cached_bytes" (memory held on free lists). */
+Json Json::allocation_stats() {
+    const json_pool& p = pool;
+    return Json::make_object().set("allocations", p.allocations)
+        .set("frees", p.frees)
+        .set("reuses", p.reuses)
+        .set("mallocs", p.mallocs)
+        .set("arena_allocations", p.arena_allocations)
+        .set("cached_bytes", p.cached_bytes);
+}
+
+
+// Arenas
+
+Json::arena::arena(size_t chunk_size)
+    : chunk_(), pos_(), end_(), chunk_size_(chunk_size) {
+}
+
+Json::arena::~arena() {
+    retire(chunk_);
+}
+
+void* Json::arena::allocate(size_t size) {
+    size = (size + 15) & ~size_t(15);
+    if (size > chunk_size_ / 4)
+        return 0;
+    if (size_t(end_ - pos_) < size) {
+        retire(chunk_);
+        char* buf = static_cast<char*>(malloc(chunk_size_));
+        if (!buf)
+            throw std::bad_alloc();
+        chunk_ = new((void*) buf) chunk;
+        chunk_->retired = false;
+        chunk_->live = 0;
+        pos_ = buf + ((sizeof(chunk) + 15) & ~size_t(15));
+        end_ = buf + chunk_size_;
+    }
+    json_block* b = reinterpret_cast<json_block*>(pos_);
+    pos_ += size;
+    b->chunk = chunk_;
+    b->klass = 0;
+    ++chunk_->live;
+    return b;
+}
+
+void Json::arena::release(chunk* c) {
+    if (--c->live == 0 && c->retired)
+        free(c);
+}
+
+void Json::arena::retire(chunk* c) {
+    if (c) {
+        c->retired = true;
+        if (c->live == 0)
+            free(c);
+    }
+}
+
+Json::arena::scope::scope(arena* a)
+    : old_(pool.arena) {
+    if (a)
+        pool.arena = a;
+}
+
+Json::arena::scope::~scope() {
+    pool.arena = old_;
+}
+
+
 // Array internals
 
 Json::ArrayJson* Json::ArrayJson::make(int n) {
     int cap = n < 8 ? 8 : n;
-    char* buf = new char[sizeof(ArrayJson) + cap * sizeof(Json)];
-    return new((void*) buf) ArrayJson(cap);
+    void* buf = Json::allocate(sizeof(ArrayJson) + cap * sizeof(Json));
+    return new(buf) ArrayJson(cap);
 }
 
 void Json::ArrayJson::destroy(ArrayJson* aj) {
     if (aj)
         for (int i = 0; i != aj->size; ++i)
             aj->a[i].~Json();
-    delete[] reinterpret_cast<char*>(aj);
+    Json::deallocate(aj);
 }
 
 
@@ -91,7 +271,7 @@ Json::ObjectJson::~ObjectJson()
     for (; ob != oe; ++ob)
 	if (ob->next_ > -2)
 	    ob->~ObjectItem();
-    delete[] reinterpret_cast<char *>(os_);
+    Json::deallocate(os_);
 }
 
 void Json::ObjectJson::grow(bool copy)
@@ -105,7 +285,7 @@ void Json::ObjectJson::grow(bool copy)
 	new_capacity = capacity_ * 2;
     else
 	new_capacity = 8;
-    ObjectItem *new_os = reinterpret_cast<ObjectItem *>(operator new[](sizeof(ObjectItem) * new_capacity));
+    ObjectItem *new_os = reinterpret_cast<ObjectItem *>(Json::allocate(sizeof(ObjectItem) * new_capacity));
     ObjectItem *ob = os_, *oe = ob + n_;
     for (ObjectItem *oi = new_os; ob != oe; ++oi, ++ob) {
 	if (ob->next_ == -2)
@@ -116,7 +296,7 @@ void Json::ObjectJson::grow(bool copy)
             memcpy(oi, ob, sizeof(ObjectItem));
     }
     if (!copy)
-	operator delete[](reinterpret_cast<void *>(os_));
+	Json::deallocate(os_);
     os_ = new_os;
     capacity_ = new_capacity;
 }
@@ -247,7 +427,7 @@ void Json::hard_uniqueify_array(bool convert, int ncap_in) {
     if (old_u.x.type == j_array && old_u.a.x && old_u.a.x->refcount == 1) {
         u_.a.x->size = old_u.a.x->size;
         memcpy(u_.a.x->a, old_u.a.x->a, sizeof(Json) * u_.a.x->size);
-        delete[] reinterpret_cast<char*>(old_u.a.x);
+        Json::deallocate(old_u.a.x);
     } else if (old_u.x.type == j_array && old_u.a.x) {
         u_.a.x->size = old_u.a.x->size;
         Json* last = u_.a.x->a + u_.a.x->size;
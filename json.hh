@@ -333,6 +333,10 @@ class Json {
 
     inline void swap(Json& x);
 
+    // Memory
+    class arena;
+    static Json allocation_stats();
+
   private:
     enum {
 	st_initial = 0, st_array_initial = 1, st_array_delim = 2,
@@ -357,6 +361,9 @@ class Json {
     struct ObjectItem;
     struct ObjectJson;
 
+    static void* allocate(size_t size);
+    static void deallocate(void* p);
+
     union rep_type {
         Json_rep_item<int64_t> i;
         Json_rep_item<uint64_t> u;
@@ -441,6 +448,12 @@ struct Json::ObjectJson : public ComplexJson {
     }
     ObjectJson(const ObjectJson& x);
     ~ObjectJson();
+    static void* operator new(size_t size) {
+        return Json::allocate(size);
+    }
+    static void operator delete(void* p) {
+        Json::deallocate(p);
+    }
     void grow(bool copy);
     int bucket(const char* s, int len) const {
 	return String::hashcode(s, s + len) & (hash_.size() - 1);
@@ -471,6 +484,46 @@ struct Json::ObjectJson : public ComplexJson {
     void rehash();
 };
 
+/** @class Json::arena
+    @brief Scoped allocation region for Json arrays and objects.
+
+    While a Json::arena::scope is active, array and object storage created
+    by the current thread is carved sequentially from the arena's chunks
+    rather than taken from the per-thread size-classed pools. Freeing an
+    arena node only decrements its chunk's live count; a chunk is returned
+    to the system in one shot once the arena has moved past it and its last
+    node has died. Json values built in an arena may outlive both the scope
+    and the arena itself, but must be destroyed by the arena's thread. */
+class Json::arena {
+  public:
+    explicit arena(size_t chunk_size = 65536);
+    ~arena();
+
+    class scope {
+      public:
+        explicit scope(arena* a);
+        ~scope();
+      private:
+        arena* old_;
+        scope(const scope&);
+        scope& operator=(const scope&);
+    };
+
+  private:
+    struct chunk;
+    chunk* chunk_;
+    char* pos_;
+    char* end_;
+    size_t chunk_size_;
+
+    void* allocate(size_t size);
+    static void release(chunk* c);
+    static void retire(chunk* c);
+    arena(const arena&);
+    arena& operator=(const arena&);
+    friend class Json;
+};
+
 inline const Json& Json::make_null() {
     return null_json;
 }
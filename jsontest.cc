@@ -562,6 +562,33 @@ int main(int argc, char** argv) {
         CHECK(a.size() == 4);
     }
 
+    {
+        Json::parse("[[1,2],{\"a\":[3]}]");
+        Json s0 = Json::allocation_stats();
+        Json j = Json::parse("[[1,2],{\"a\":[3]}]");
+        CHECK(j.unparse() == "[[1,2],{\"a\":[3]}]");
+        j = Json();
+        Json s1 = Json::allocation_stats();
+        CHECK(s1["allocations"].to_i() - s0["allocations"].to_i() >= 5);
+        CHECK(s1["reuses"].to_i() - s0["reuses"].to_i() >= 5);
+        CHECK(s1["mallocs"].to_i() == s0["mallocs"].to_i());
+    }
+
+    {
+        Json j;
+        {
+            Json::arena arena;
+            Json::arena::scope scope(&arena);
+            Json s0 = Json::allocation_stats();
+            j = Json::parse("{\"a\":[1,2,3],\"b\":{\"c\":null}}");
+            Json s1 = Json::allocation_stats();
+            CHECK(s1["arena_allocations"].to_i() - s0["arena_allocations"].to_i() >= 4);
+        }
+        CHECK(j.unparse() == "{\"a\":[1,2,3],\"b\":{\"c\":null}}");
+        j["a"].push_back(4);
+        CHECK(j["a"].unparse() == "[1,2,3,4]");
+    }
+
     std::cout << "All tests pass!\n";
     return 0;
 }
@@ -0,0 +1,148 @@
+#include "mpcompress.hh"
+#include <stdint.h>
+#include <string.h>
+
+namespace mpcompress {
+
+namespace {
+enum { hash_bits = 12, min_match = 4, max_offset = 65535,
+       last_literals = 5, match_margin = 12 };
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+inline unsigned hash(uint32_t x) {
+    return (x * 2654435761U) >> (32 - hash_bits);
+}
+
+// Append the part of a run length that did not fit in the token.
+inline uint8_t* put_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+inline bool get_length(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+    unsigned b;
+    do {
+        if (ip == iend)
+            return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+inline uint8_t* put_literals(uint8_t* op, const uint8_t* first, size_t n) {
+    uint8_t* token = op++;
+    *token = (n >= 15 ? 15 : n) << 4;
+    if (n >= 15)
+        op = put_length(op, n - 15);
+    memcpy(op, first, n);
+    return op + n;
+}
+}
+
+/** @brief Compress the @a n bytes at @a src into @a dst.
+
+    @a dst must have room for bound(@a n) bytes. Returns the compressed
+    length. */
+size_t compress(const char* src_, size_t n, char* dst_) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(src_);
+    uint8_t* op = reinterpret_cast<uint8_t*>(dst_);
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+
+    if (n >= size_t(match_margin)) {
+        uint32_t table[1 << hash_bits];
+        memset(table, 0, sizeof(table));
+        const uint8_t* ip = src + 1;
+        const uint8_t* ilimit = end - match_margin;
+        const uint8_t* mlimit = end - last_literals;
+        while (ip <= ilimit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = ip - src;
+            if (ip - ref > max_offset || read32(ref) != seq) {
+                ++ip;
+                continue;
+            }
+
+            // extend backward over literals, then forward
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+                --ip, --ref;
+            const uint8_t* mp = ip + min_match;
+            const uint8_t* rp = ref + min_match;
+            while (mp < mlimit && *mp == *rp)
+                ++mp, ++rp;
+
+            uint8_t* token = op;
+            op = put_literals(op, anchor, ip - anchor);
+            size_t offset = ip - ref;
+            *op++ = offset;
+            *op++ = offset >> 8;
+            size_t mlen = mp - ip - min_match;
+            *token |= mlen >= 15 ? 15 : mlen;
+            if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+            ip = anchor = mp;
+        }
+    }
+
+    op = put_literals(op, anchor, end - anchor);
+    return op - reinterpret_cast<uint8_t*>(dst_);
+}
+
+/** @brief Decompress the @a n-byte block at @a src into @a dst.
+
+    Returns the decompressed length, or -1 if the block is malformed or
+    would expand past @a cap bytes. Never reads or writes out of
+    bounds, whatever the input. */
+ssize_t decompress(const char* src_, size_t n, char* dst_, size_t cap) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(src_);
+    const uint8_t* iend = ip + n;
+    uint8_t* dst = reinterpret_cast<uint8_t*>(dst_);
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip != iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_length(ip, iend, lit))
+            return -1;
+        if (size_t(iend - ip) < lit || size_t(oend - op) < lit)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)         // the last run has no match
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_length(ip, iend, mlen))
+            return -1;
+        mlen += min_match;
+        if (offset == 0 || offset > size_t(op - dst)
+            || size_t(oend - op) < mlen)
+            return -1;
+        const uint8_t* ref = op - offset;
+        if (offset >= mlen)
+            memcpy(op, ref, mlen);
+        else                    // overlapping: repeats a short pattern
+            for (size_t i = 0; i != mlen; ++i)
+                op[i] = ref[i];
+        op += mlen;
+    }
+    return op - dst;
+}
+
+} // namespace mpcompress
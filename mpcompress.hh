@@ -0,0 +1,28 @@
+// -*- mode: c++ -*-
+#ifndef PEQUOD_MPCOMPRESS_HH
+#define PEQUOD_MPCOMPRESS_HH
+#include <sys/types.h>
+#include <stddef.h>
+
+/** @namespace mpcompress
+    @brief Fast LZ77 block compression in the LZ4 block format.
+
+    A block is a sequence of literal runs and back-references of at most
+    64 KiB, found with a single-probe hash table. This trades ratio for
+    speed: it catches the repeated field names and identifiers typical
+    of msgpack traffic at hundreds of megabytes per second, and needs no
+    external library. */
+namespace mpcompress {
+
+inline size_t bound(size_t n);
+size_t compress(const char* src, size_t n, char* dst);
+ssize_t decompress(const char* src, size_t n, char* dst, size_t cap);
+
+/** @brief Return the largest size compress() can produce from @a n
+    bytes. */
+inline size_t bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+} // namespace mpcompress
+#endif
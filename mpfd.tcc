@@ -1,30 +1,78 @@
 // -*- mode: c++ -*-
 #include "mpfd.hh"
+#include "mpuring.hh"
+#include "mpshm.hh"
+#include "mpcompress.hh"
 #include <limits.h>
+#include <algorithm>
+#include <functional>
+#include <sys/socket.h>
 #include <tamer/adapter.hh>
 #ifndef IOV_MAX
 #define IOV_MAX 1024
 #endif
 
+namespace {
+// Transport control messages are msgpack fixext1 elements of a reserved
+// extension type, holding one opcode byte. Json has no extension values,
+// so no application message takes this form.
+const uint8_t control_type = 0x6D;
+const size_t control_len = 3;
+enum { control_compress_offer = 1, control_compress = 2 };
+}
+
 void msgpack_fd::reset() {
     wrpos_ = 0;
     wrsize_ = 0;
     wrblocked_ = false;
+    wrdelayed_ = false;
     rdpos_ = 0;
     rdlen_ = 0;
+    rdwant_ = 1;
     rdquota_ = rdbatch;
-    rdreply_seq_ = 0;
+    rdblocked_ = false;
+    rdringop_ = 0;
+    rdchunkleft_ = 0;
+    rdcall_seq_ = 0;
+    wrzon_ = false;
+    wrzpos_ = 0;
+    rdzon_ = false;
+    rdzpos_ = 0;
+    rdzlen_ = 0;
+    rdzwant_ = zheader;
 }
 
 void msgpack_fd::construct() {
     reset();
     wrlowat_ = 1 << 12;
     wrtotal_ = 0;
-    rdbuf_ = String::make_uninitialized(rdcap);
+    wrsyscalls_ = 0;
+    wrmsgs_ = 0;
+    wrlast_ = 0;
+    wrdelay_ = 0;
+    wrcork_ = false;
+    rdcap_ = rdmincap;
     rdtotal_ = 0;
+    rdcopied_ = 0;
+    rdlast_ = 0;
+    rdring_ = 0;
+    rdfdpass_ = false;
+    rdmaxsize_ = 64 << 20;
+    rdmaxdepth_ = 512;
+    rdrejected_ = 0;
+    rdchunkmin_ = 0;
+    zon_ = false;
+    wrzraw_ = wrzout_ = 0;
+    wrzns_ = 0;
+    rdzin_ = rdzout_ = 0;
+    rdzns_ = 0;
+    shm_ = 0;
+    dltimeout_ = 0;
+    dlexpired_ = 0;
+    rdlate_ = 0;
 
+    // buffers are allocated on demand and grow with traffic
     wrelem_.push_back(wrelem());
-    wrelem_.back().sa.reserve(wrcap);
     wrelem_.back().pos = 0;
 }
 
@@ -32,17 +80,50 @@ void msgpack_fd::initialize(tamer::fd rfd, tamer::fd wfd) {
     assert(!wfd_ && !rfd_ && !wrkill_ && !rdkill_ && !wrwake_ && !rdwake_);
     wfd_ = wfd;
     rfd_ = rfd;
+    if (rdfdpass_)
+        zon_ = false;
+    if (!rdfdpass_ && !shm_ && !zon_)
+        rdring_ = uring_driver::get();
     writer_coroutine();
     reader_coroutine();
+    if (zon_)
+        write_control(control_compress_offer);
+}
+
+/** @brief Initialize to exchange messages over @a ch.
+
+    The msgpack_fd takes ownership of @a ch and deletes it, closing the
+    channel, when cleared or destroyed. Reads and writes go through the
+    shared-memory rings; the channel's wait descriptors stand in for a
+    socket's readiness. */
+void msgpack_fd::initialize(shm_channel* ch) {
+    assert(!shm_);
+    shm_ = ch;
+    initialize(tamer::fd(dup(ch->read_wait_fd())),
+               tamer::fd(dup(ch->write_wait_fd())));
 }
 
 void msgpack_fd::destroy() {
     wrkill_();
     rdkill_();
+    dlkill_();
     wrwake_();
     rdwake_();
+    dlwake_();
+    if (rdringop_)
+        rdring_->cancel(rdringop_);
     clear_write();
     clear_read();
+    give_buffer(rdbuf_);
+    rdpos_ = rdlen_ = 0;
+    for (auto& f : wrfds_)
+        close(f.second);
+    wrfds_.clear();
+    for (int f : rdfds_)
+        close(f);
+    rdfds_.clear();
+    delete shm_;
+    shm_ = 0;
 }
 
 void msgpack_fd::clear() {
@@ -52,7 +133,10 @@ void msgpack_fd::clear() {
         wrelem_.pop_front();
     wrelem_[0].sa.clear();
     wrelem_[0].pos = 0;
+    wrzbuf_.clear();
+    rdzbuf_ = String();
     rdreqq_.clear();
+    rdframe_ = String();
     reset();
 }
 
@@ -61,17 +145,24 @@ void msgpack_fd::clear_write() {
         e.e.trigger((ssize_t) (wrpos_ - e.wpos) >= 0);
     flushelem_.clear();
     for (auto& e : rdreplywait_)
-        if ((ssize_t) (wrpos_ - e.wpos) < 0)
-            e.e.trigger(Json());
+        if ((ssize_t) (wrpos_ - e.second.wpos) < 0)
+            e.second.e.trigger(Json());
 }
 
 void msgpack_fd::clear_read() {
-    for (auto& e : rdreqwait_)
-        e.unblock();
+    for (auto& e : rdreqwait_) {
+        e.e.unblock();
+        e.ve.unblock();
+    }
     rdreqwait_.clear();
     for (auto& re : rdreplywait_)
-        re.e.unblock();
+        re.second.e.unblock();
     rdreplywait_.clear();
+    for (auto& e : rdchunkwait_)
+        e.unblock();
+    rdchunkwait_.clear();
+    rdchunkleft_ = 0;
+    dlheap_.clear();
 }
 
 msgpack_fd::~msgpack_fd() {
@@ -81,33 +172,32 @@ msgpack_fd::~msgpack_fd() {
 void msgpack_fd::write(const Json& j, bool iscall) {
     assert(!iscall || j.is_a());
 
-    // find StringAccum to write into
-    wrelem* w = &wrelem_.back();
-    if (w->sa.length() >= wrhiwat) {
-        wrelem_.push_back(wrelem());
-        w = &wrelem_.back();
-        w->sa.reserve(wrcap);
-        w->pos = 0;
-    }
+    wrelem* w = &prepare_write();
     int old_len = w->sa.length();
 
     // serialize Json to w->sa
     msgpack::unparser<StringAccum> mu(w->sa);
     if (iscall && j[1].is_null()) { // assign sequence number
-        mu << msgpack::array(std::max(j.size(), 2)) << j[0]
-           << (rdreply_seq_ + rdreplywait_.size());
+        mu << msgpack::array(std::max(j.size(), 2)) << j[0] << rdcall_seq_;
         for (int i = 2; i < j.size(); ++i)
             mu << j[i];
     } else {
-        if (iscall && rdreplywait_.empty())
-            rdreply_seq_ = j[1].as_u();
+        if (iscall)
+            rdcall_seq_ = j[1].as_u();
         mu << j;
     }
 
+    finish_write(old_len);
+}
+
+void msgpack_fd::finish_write(int old_len) {
     // write (if over low-water mark), wake coroutine
+    wrelem* w = &wrelem_.back();
     wrsize_ += w->sa.length() - old_len;
     wrtotal_ += w->sa.length() - old_len;
-    if (wrsize_ >= wrlowat_ && !wrblocked_)
+    ++wrmsgs_;
+    wrlast_ = tamer::drecent();
+    if (wrsize_ >= (wrcork_ ? size_t(wrcap) : wrlowat_) && !wrblocked_)
         write_once();
     if (wrsize_ > 0 && wrwake_) {
         tamer::at_asap(std::move(wrwake_));
@@ -133,48 +223,452 @@ inline void msgpack_fd::check_coroutines() {
         wrwake_();
 }
 
+// Receive buffers are pooled per process, and so per event loop. A
+// connection returns its buffer whenever it has drained it, even if
+// parsed strings still alias it; the pool lends a buffer out again only
+// once the pool holds its last reference. Buffer memory thus follows the
+// data in flight, not the number of connections.
+
+namespace {
+struct msgpack_fd_buffer_pool {
+    enum { nclass = 6, class_bytes = 4 << 20, scan = 8 };
+    std::deque<String> free[nclass];
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long returns;
+};
+msgpack_fd_buffer_pool rdpool;
+
+int buffer_class(size_t size, size_t mincap) {
+    int c = 0;
+    for (size_t sz = mincap; sz < size; sz *= 2)
+        ++c;
+    if (c >= msgpack_fd_buffer_pool::nclass || size != mincap << c)
+        return -1;
+    return c;
+}
+}
+
+String msgpack_fd::take_buffer(size_t size) {
+    int c = buffer_class(size, rdmincap);
+    if (c >= 0) {
+        std::deque<String>& q = rdpool.free[c];
+        size_t n = std::min(q.size(), size_t(msgpack_fd_buffer_pool::scan));
+        for (size_t i = 0; i != n; ++i)
+            if (!q[i].is_shared()) {
+                String buf = std::move(q[i]);
+                q.erase(q.begin() + i);
+                ++rdpool.hits;
+                return buf;
+            }
+    }
+    ++rdpool.misses;
+    return String::make_uninitialized(size);
+}
+
+void msgpack_fd::give_buffer(String& buf) {
+    int c = buffer_class(buf.length(), rdmincap);
+    if (c >= 0 && buf.data() && !buf.is_stable()) {
+        std::deque<String>& q = rdpool.free[c];
+        if (q.size() >= size_t(msgpack_fd_buffer_pool::class_bytes) / buf.length())
+            q.pop_front();
+        q.push_back(std::move(buf));
+        ++rdpool.returns;
+    }
+    buf = String();
+}
+
+void msgpack_fd::release_read_buffer() {
+    if (rdbuf_ && rdpos_ == rdlen_) {
+        give_buffer(rdbuf_);
+        rdpos_ = rdlen_ = 0;
+    }
+}
+
+/** @brief Return counters for the shared receive-buffer pool.
+
+    "hits" and "misses" count buffer requests served from the pool and
+    by allocation; "returns" counts buffers handed back; "buffers" and
+    "bytes" describe what the pool currently holds. */
+Json msgpack_fd::buffer_pool_status() {
+    size_t nbuf = 0, nbytes = 0;
+    for (int c = 0; c != msgpack_fd_buffer_pool::nclass; ++c) {
+        nbuf += rdpool.free[c].size();
+        nbytes += rdpool.free[c].size() * (size_t(rdmincap) << c);
+    }
+    return Json().set("hits", rdpool.hits)
+        .set("misses", rdpool.misses)
+        .set("returns", rdpool.returns)
+        .set("buffers", nbuf)
+        .set("bytes", nbytes);
+}
+
 bool msgpack_fd::read_one_message() {
     assert(rdquota_ != 0);
 
  readmore:
-    // if buffer empty, read more data
-    if (rdpos_ == rdlen_) {
-        // make new buffer or reuse existing buffer
-        if (rdcap - rdpos_ < 4096) {
-            if (rdbuf_.is_shared())
-                rdbuf_ = String::make_uninitialized(rdcap);
-            rdpos_ = rdlen_ = 0;
+    // a chunked payload goes to its readers before any later message
+    if (rdchunkleft_) {
+        deliver_payload();
+        if (rdchunkleft_ && rdchunkwait_.empty())
+            return false;
+    }
+
+    // look for a complete message
+    if (!rdchunkleft_ && rdlen_ - rdpos_ >= rdwant_) {
+        const uint8_t* first = rdbuf_.ubegin() + rdpos_;
+        if (*first == msgpack::format::ffixext1) {
+            if (rdlen_ - rdpos_ < control_len)
+                rdwant_ = control_len;
+            else {
+                rdpos_ += control_len;
+                rdwant_ = 1;
+                control_message(first[1], first[2]);
+                if (!rfd_)
+                    return false;
+            }
+            goto readmore;
         }
+        ssize_t len = msgpack::element_length(first, rdbuf_.ubegin() + rdlen_,
+                                              &rdwant_);
+        if (len < 0)
+            return reject_message(-EPROTO);
+        else if (len > 0) {
+            if (size_t(len) > rdmaxsize_)
+                return reject_message(-EMSGSIZE);
+            // depth cannot exceed length, so most messages skip the walk
+            if (size_t(len) > size_t(rdmaxdepth_)
+                && msgpack::element_depth(first, first + len) > rdmaxdepth_)
+                return reject_message(-EPROTO);
+            rdframe_ = rdbuf_.fast_substring(first, first + len);
+            rdpos_ += len;
+            rdwant_ = 1;
+        } else if (rdchunkmin_ && rdwant_ >= rdchunkmin_
+                   && start_payload(first)) {
+            if (rdframe_.empty())
+                return false;
+        } else if (rdwant_ > rdmaxsize_)
+            return reject_message(-EMSGSIZE);
+        if (len > 0 || rdchunkleft_) {
+            --rdquota_;
+            if (rdquota_ == 0)
+                rdwake_();      // wake up coroutine [if it's sleeping]
+            return true;
+        }
+    }
 
-        ssize_t amt = ::read(rfd_.value(),
-                             const_cast<char*>(rdbuf_.data()) + rdpos_,
-                             rdcap - rdpos_);
-
-        if (amt != 0 && amt != (ssize_t) -1) {
-            rdlen_ += amt;
-            rdtotal_ += amt;
-        } else {
-            if (amt == 0)
-                rfd_.close();
-            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
-                rfd_.close(-errno);
-            rdquota_ = 0;
-            check_coroutines(); // wake up coroutine [if it's sleeping]
+    // a ring read in flight owns the buffer tail
+    if (rdringop_)
+        return false;
+
+    // compressed data arrives in rdzbuf_ and is inflated into rdbuf_ a
+    // frame at a time
+    if (rdzon_) {
+        int r = inflate_frame();
+        if (r > 0)
+            goto readmore;
+        else if (r < 0)
+            return reject_message(-EPROTO);
+        prepare_compressed_read();
+        ssize_t zamt = read_some(const_cast<char*>(rdzbuf_.data()) + rdzlen_,
+                                 rdzbuf_.length() - rdzlen_);
+        if (zamt <= 0) {
+            read_complete(zamt == 0 ? 0 : -errno);
             return false;
         }
+        rdzlen_ += zamt;
+        rdtotal_ += zamt;
+        rdlast_ = tamer::drecent();
+        rdblocked_ = false;
+        goto readmore;
     }
 
-    // process new data
-    rdpos_ += rdparser_.consume(rdbuf_.begin() + rdpos_, rdlen_ - rdpos_,
-                                rdbuf_);
+    // otherwise read more data
+    prepare_read(std::max(rdwant_, size_t(4096)));
 
-    if (rdparser_.done()) {
-        --rdquota_;
-        if (rdquota_ == 0)
-            rdwake_();          // wake up coroutine [if it's sleeping]
+    // with io_uring, the reader coroutine submits the read
+    if (rdring_) {
+        rdblocked_ = true;
+        rdquota_ = 0;
+        check_coroutines();
+        return false;
+    }
+
+    ssize_t amt = read_some(const_cast<char*>(rdbuf_.data()) + rdlen_,
+                            rdbuf_.length() - rdlen_);
+    if (!read_complete(amt >= 0 ? amt : -errno))
+        return false;
+    goto readmore;
+}
+
+// Messages are framed contiguously in rdbuf_, so that parsed strings can
+// alias it. Make room for @a want bytes from rdpos_: make a new buffer,
+// or reuse the existing buffer, if the rest of the message won't fit.
+void msgpack_fd::prepare_read(size_t want) {
+    size_t cap = rdbuf_.length();
+    if (cap - rdpos_ < want) {
+        if (!rdbuf_ && rdlast_ <= tamer::drecent() - idle_msec / 1000.0)
+            rdcap_ = rdmincap;  // idle connection: start small again
+        size_t tail = rdlen_ - rdpos_;
+        size_t newcap = rdcap_;
+        while (newcap < want)
+            newcap *= 2;
+        if (rdbuf_.is_shared() || cap < newcap) {
+            String buf = take_buffer(newcap);
+            memcpy(const_cast<char*>(buf.data()),
+                   rdbuf_.data() + rdpos_, tail);
+            give_buffer(rdbuf_);
+            rdbuf_ = std::move(buf);
+        } else
+            memmove(const_cast<char*>(rdbuf_.data()),
+                    rdbuf_.data() + rdpos_, tail);
+        rdcopied_ += tail;
+        rdpos_ = 0;
+        rdlen_ = tail;
+    }
+}
+
+ssize_t msgpack_fd::read_some(char* buf, size_t len) {
+    if (shm_)
+        return shm_->read(buf, len);
+    else if (rdfdpass_)
+        return receive_fds(buf, len);
+    else
+        return ::read(rfd_.value(), buf, len);
+}
+
+void msgpack_fd::write_control(uint8_t op) {
+    const char frame[] = {char(msgpack::format::ffixext1), char(control_type),
+                          char(op)};
+    write_with([&](msgpack::unparser<StringAccum>& mu) {
+            mu.write_raw(Str(frame, control_len));
+        });
+}
+
+// Handle a transport control message (see set_compression()).
+void msgpack_fd::control_message(uint8_t type, uint8_t op) {
+    if (type == control_type && op == control_compress_offer) {
+        if (zon_ && !wrzon_) {
+            write_control(control_compress);
+            wrzon_ = true;
+            wrzstart_ = wrpos_ + wrsize_;
+        }
+    } else if (type == control_type && op == control_compress
+               && zon_ && !rdzon_)
+        start_read_compression();
+    else
+        reject_message(-EPROTO);
+}
+
+// The peer compresses everything after its "compress" message, so any
+// bytes already read past that message are compressed.
+void msgpack_fd::start_read_compression() {
+    size_t tail = rdlen_ - rdpos_;
+    rdzon_ = true;
+    rdzbuf_ = String::make_uninitialized(std::max(tail + 4096,
+                                                  size_t(rdmaxcap)));
+    memcpy(const_cast<char*>(rdzbuf_.data()), rdbuf_.data() + rdpos_, tail);
+    rdzpos_ = 0;
+    rdzlen_ = tail;
+    rdzwant_ = zheader;
+    rdlen_ = rdpos_;
+}
+
+// Compressed frames start with a header of two 32-bit words: the frame's
+// length, with the top bit set if it is stored uncompressed, and the
+// length it inflates to.
+
+// Inflate one complete frame from rdzbuf_ onto the end of rdbuf_.
+// Returns 1 if it did, 0 if no frame is complete, and -1 on corrupt data.
+int msgpack_fd::inflate_frame() {
+    if (rdzlen_ - rdzpos_ < zheader) {
+        rdzwant_ = zheader;
+        return 0;
+    }
+    const char* p = rdzbuf_.data() + rdzpos_;
+    uint32_t zword = read_in_net_order<uint32_t>(p);
+    size_t rawlen = read_in_net_order<uint32_t>(p + 4);
+    bool stored = zword >> 31;
+    size_t zlen = zword & 0x7FFFFFFFU;
+    if (rawlen > zframe || zlen > mpcompress::bound(zframe)
+        || (stored && zlen != rawlen))
+        return -1;
+    if (rdzlen_ - rdzpos_ < zheader + zlen) {
+        rdzwant_ = zheader + zlen;
+        return 0;
+    }
+
+    prepare_read(rdlen_ - rdpos_ + rawlen);
+    char* out = const_cast<char*>(rdbuf_.data()) + rdlen_;
+    uint64_t t0 = clock_ns();
+    if (stored)
+        memcpy(out, p + zheader, rawlen);
+    else if (mpcompress::decompress(p + zheader, zlen, out, rawlen)
+             != ssize_t(rawlen))
+        return -1;
+    rdzns_ += clock_ns() - t0;
+    rdlen_ += rawlen;
+    rdzpos_ += zheader + zlen;
+    rdzin_ += zheader + zlen;
+    rdzout_ += rawlen;
+    rdzwant_ = zheader;
+    return 1;
+}
+
+// Make room in rdzbuf_ for the rest of the current frame, and at least
+// 4 KiB more.
+void msgpack_fd::prepare_compressed_read() {
+    size_t tail = rdzlen_ - rdzpos_;
+    size_t want = std::max(rdzwant_, tail + 4096);
+    size_t cap = rdzbuf_.length();
+    if (cap - rdzpos_ < want) {
+        size_t newcap = std::max(cap, size_t(rdmaxcap));
+        while (newcap < want)
+            newcap *= 2;
+        if (newcap != cap) {
+            String buf = String::make_uninitialized(newcap);
+            memcpy(const_cast<char*>(buf.data()),
+                   rdzbuf_.data() + rdzpos_, tail);
+            rdzbuf_ = std::move(buf);
+        } else
+            memmove(const_cast<char*>(rdzbuf_.data()),
+                    rdzbuf_.data() + rdzpos_, tail);
+        rdcopied_ += tail;
+        rdzpos_ = 0;
+        rdzlen_ = tail;
+    }
+}
+
+// Refuse the message at rdpos_ and reset the connection with @a err.
+// Returns false, as read_one_message does when no message is ready.
+bool msgpack_fd::reject_message(int err) {
+    ++rdrejected_;
+    rdframe_ = String();
+    rdpos_ = rdlen_;
+    rdwant_ = 1;
+    if (rdringop_)
+        rdring_->cancel(rdringop_);
+    rfd_.close(err);
+    wfd_.close(err);
+    rdblocked_ = true;
+    rdquota_ = 0;
+    check_coroutines();
+    return false;
+}
+
+// Deliver the head of the incomplete message at @a first, whose trailing
+// payload will follow through read_payload(). The head carries the
+// payload's length in place of the payload. Returns false if the message
+// does not qualify; on success, rdframe_ is the head, or empty if the
+// connection was reset instead.
+bool msgpack_fd::start_payload(const uint8_t* first) {
+    size_t hlen, plen;
+    ssize_t off = msgpack::trailing_payload(first, rdbuf_.ubegin() + rdlen_,
+                                            &hlen, &plen);
+    if (off < 0 || plen < rdchunkmin_)
+        return false;
+    if (off + hlen > rdmaxsize_) {
+        reject_message(-EMSGSIZE);
         return true;
-    } else
-        goto readmore;
+    }
+    StringAccum sa;
+    sa.append(first, off);
+    msgpack::unparser<StringAccum>(sa) << plen;
+    String head = sa.take_string();
+    if (size_t(head.length()) > size_t(rdmaxdepth_)
+        && msgpack::element_depth(head.ubegin(), head.uend()) > rdmaxdepth_) {
+        reject_message(-EPROTO);
+        return true;
+    }
+    rdframe_ = std::move(head);
+    rdpos_ += off + hlen;
+    rdwant_ = 1;
+    rdchunkleft_ = plen;
+    return true;
+}
+
+// Hand buffered payload bytes to waiting read_payload() calls. Chunks
+// alias the receive buffer.
+void msgpack_fd::deliver_payload() {
+    while (rdchunkleft_ && !rdchunkwait_.empty() && rdpos_ != rdlen_) {
+        size_t n = std::min(rdchunkleft_, rdlen_ - rdpos_);
+        const char* s = rdbuf_.data() + rdpos_;
+        rdchunkwait_.front().trigger(rdbuf_.fast_substring(s, s + n));
+        rdchunkwait_.pop_front();
+        rdpos_ += n;
+        rdchunkleft_ -= n;
+    }
+}
+
+/** @brief Receive the next piece of the current chunked payload.
+
+    @a done receives the next bytes of the payload announced by the
+    message just delivered (see set_payload_threshold()), as many as have
+    arrived, or an empty string if no payload remains or the connection
+    closes first. */
+void msgpack_fd::read_payload(tamer::event<String> done) {
+    if (!rdchunkleft_) {
+        done(String());
+        return;
+    }
+    rdchunkwait_.push_back(std::move(done));
+    deliver_payload();
+    if (!rdchunkwait_.empty())
+        rdwake_();
+}
+
+ssize_t msgpack_fd::receive_fds(char* buf, size_t len) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * wrmaxfds)];
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t amt = recvmsg(rfd_.value(), &msg, MSG_CMSG_CLOEXEC);
+    if (amt > 0)
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+            if (cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS) {
+                int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+                int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                rdfds_.insert(rdfds_.end(), fds, fds + n);
+            }
+    // untaken descriptors pile up: treat that as a protocol error
+    if (rdfds_.size() > size_t(rdmaxfds)) {
+        ++rdrejected_;
+        errno = EMFILE;
+        return -1;
+    }
+    return amt;
+}
+
+// Account for @a amt bytes read into rdbuf_ at rdlen_, or for EOF (0) or
+// an error (-errno). Returns true iff data arrived.
+bool msgpack_fd::read_complete(ssize_t amt) {
+    if (amt > 0) {
+        // a full read suggests more is waiting: grow the next buffer
+        if (size_t(amt) == rdbuf_.length() - rdlen_ && rdcap_ < rdmaxcap)
+            rdcap_ *= 2;
+        rdlen_ += amt;
+        rdtotal_ += amt;
+        rdlast_ = tamer::drecent();
+        rdblocked_ = false;
+        return true;
+    }
+    if (amt == 0)
+        rfd_.close();
+    else if (amt != -EAGAIN && amt != -EWOULDBLOCK && amt != -EINTR)
+        rfd_.close(amt);
+    rdblocked_ = true;
+    rdquota_ = 0;
+    check_coroutines(); // wake up coroutine [if it's sleeping]
+    return false;
 }
 
 tamed void msgpack_fd::reader_coroutine() {
@@ -186,24 +680,43 @@ tamed void msgpack_fd::reader_coroutine() {
     tvars {
         tamer::event<> kill;
         tamer::rendezvous<> rendez;
+        String ringbuf;
+        ssize_t amt;
     }
 
     kill = rdkill_ = tamer::make_event(rendez);
 
     while (kill && rfd_) {
-        if (rdquota_ == 0 && rdpos_ != rdlen_)
+        if (rdquota_ == 0 && !rdblocked_)
             twait { tamer::at_asap(make_event()); }
-        else if (rdquota_ == 0)
+        else if (rdquota_ == 0 && rdring_) {
+            // `ringbuf` keeps the buffer alive until the kernel is done
+            ringbuf = rdbuf_;
+            twait {
+                rdringop_ = rdring_->read(rfd_.value(),
+                                          const_cast<char*>(ringbuf.data()) + rdlen_,
+                                          ringbuf.length() - rdlen_,
+                                          make_event(amt));
+            }
+            ringbuf = String();
+            if (!kill)
+                break;
+            rdringop_ = 0;
+            read_complete(amt);
+        } else if (rdquota_ == 0) {
+            release_read_buffer();
             twait { tamer::at_fd_read(rfd_.value(), make_event()); }
-        else if (rdreqwait_.empty() && rdreplywait_.empty())
+        } else if (!read_wanted()) {
+            if (rdpos_ == rdlen_)
+                release_read_buffer();
             twait { rdwake_ = make_event(); }
+        }
 
         if (!kill)
             break;
 
         rdquota_ = rdbatch;
-        while (rdquota_ && (!rdreqwait_.empty() || !rdreplywait_.empty())
-               && read_one_message())
+        while (rdquota_ && read_wanted() && read_one_message())
             dispatch(false);
         if (pace_recovered())
             pacer_();
@@ -216,39 +729,111 @@ tamed void msgpack_fd::reader_coroutine() {
 }
 
 bool msgpack_fd::dispatch(bool exit_on_request) {
-    Json& result = rdparser_.result();
-    if (!rdparser_.success())
-        result = Json();        // XXX reset connection
-    rdparser_.reset();
-    if (result.is_a() && result[0].is_i() && result[1].is_i()
-        && result[0].as_i() < 0) {
-        unsigned long seq = result[1].as_i();
-        if (seq >= rdreply_seq_ && seq < rdreply_seq_ + rdreplywait_.size()) {
-            replyelem& done = rdreplywait_[seq - rdreply_seq_];
+    msgpack::view msg = frame_view(rdframe_);
+    // drop readers whose events already fired, e.g. by timeout
+    while (!rdreqwait_.empty() && !rdreqwait_.front().e
+           && !rdreqwait_.front().ve)
+        rdreqwait_.pop_front();
+    if (msg.is_a() && msg[0].is_i() && msg[1].is_i()
+        && msg[0].as_i() < 0) {
+        auto it = rdreplywait_.find(msg[1].as_i());
+        if (it != rdreplywait_.end()) {
+            replyelem& done = it->second;
+            if (!rdlatency_)
+                rdlatency_.reset(new latency_histogram);
+            rdlatency_->record(clock_ns() - done.issued);
             if (done.e.result_pointer())
-                swap(*done.e.result_pointer(), result);
+                parse_frame(rdframe_, *done.e.result_pointer());
             done.e.unblock();
-            while (!rdreplywait_.empty() && !rdreplywait_.front().e) {
-                rdreplywait_.pop_front();
-                ++rdreply_seq_;
-            }
-        }
+            rdreplywait_.erase(it);
+        } else
+            ++rdlate_;
+        rdframe_ = String();
         return false;
     } else if (!rdreqwait_.empty()) {
-        tamer::event<Json>& done = rdreqwait_.front();
-        if (done.result_pointer())
-            swap(*done.result_pointer(), result);
-        done.unblock();
+        reqelem& done = rdreqwait_.front();
+        if (done.ve.result_pointer())
+            *done.ve.result_pointer() = std::move(msg);
+        else if (done.e.result_pointer())
+            parse_frame(rdframe_, *done.e.result_pointer());
+        done.e.unblock();
+        done.ve.unblock();
         rdreqwait_.pop_front();
+        rdframe_ = String();
         return false;
     } else if (exit_on_request)
         return true;
     else {
-        rdreqq_.push_back(std::move(result));
+        rdreqq_.push_back(std::move(rdframe_));
+        rdframe_ = String();
         return false;
     }
 }
 
+// Deadlines form a min-heap. Answered calls leave their entries behind
+// until they reach the top; if stale entries come to dominate the heap,
+// it is rebuilt from the reply table.
+void msgpack_fd::add_deadline(unsigned long seq, uint64_t deadline) {
+    std::greater<deadlineelem> later;
+    if (dlheap_.size() >= 64 && dlheap_.size() > 2 * rdreplywait_.size()) {
+        dlheap_.clear();
+        for (auto& r : rdreplywait_)
+            if (r.second.deadline && r.first != seq)
+                dlheap_.push_back(deadlineelem(r.second.deadline, r.first));
+        std::make_heap(dlheap_.begin(), dlheap_.end(), later);
+    }
+    dlheap_.push_back(deadlineelem(deadline, seq));
+    std::push_heap(dlheap_.begin(), dlheap_.end(), later);
+    if (!dlkill_)
+        deadline_coroutine();
+    else if (dlheap_.front().second == seq)
+        dlwake_();              // new earliest deadline
+}
+
+void msgpack_fd::expire_calls() {
+    std::greater<deadlineelem> later;
+    uint64_t now = clock_ns();
+    while (!dlheap_.empty() && dlheap_.front().first <= now) {
+        unsigned long seq = dlheap_.front().second;
+        std::pop_heap(dlheap_.begin(), dlheap_.end(), later);
+        dlheap_.pop_back();
+        auto it = rdreplywait_.find(seq);
+        if (it != rdreplywait_.end() && it->second.deadline
+            && it->second.deadline <= now) {
+            it->second.e.trigger(Json::object("timeout", true));
+            rdreplywait_.erase(it);
+            ++dlexpired_;
+            if (!dlcancel_.is_null())
+                write(Json::array(dlcancel_, seq));
+        }
+    }
+    if (pace_recovered())
+        pacer_();
+}
+
+tamed void msgpack_fd::deadline_coroutine() {
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        uint64_t now;
+    }
+
+    kill = dlkill_ = tamer::make_event(rendez);
+
+    while (kill) {
+        now = clock_ns();
+        if (dlheap_.empty())
+            twait { dlwake_ = make_event(); }
+        else if (dlheap_.front().first > now)
+            twait {
+                dlwake_ = tamer::add_timeout((dlheap_.front().first - now) / 1e9,
+                                             make_event());
+            }
+        if (kill)
+            expire_calls();
+    }
+}
+
 void msgpack_fd::check() const {
     // document invariants
     assert(!wrelem_.empty());
@@ -267,53 +852,196 @@ void msgpack_fd::check() const {
     assert(wrsize == wrsize_);
 }
 
+ssize_t msgpack_fd::send_fds(struct iovec* iov, int iov_count, int nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * wrmaxfds)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+    for (int i = 0; i != nfds; ++i)
+        fds[i] = wrfds_[i].second;
+    return sendmsg(wfd_.value(), &msg, MSG_NOSIGNAL);
+}
+
 void msgpack_fd::write_once() {
     // check();
-    assert(!wrelem_.front().sa.empty());
+    assert(!write_idle());
+    if (wrzon_ && (ssize_t) (wrpos_ - wrzstart_) >= 0) {
+        write_compressed();
+        return;
+    }
 
-    struct iovec iov[3];
-    int iov_count = (wrelem_.size() > 3 ? 3 : (int) wrelem_.size());
-    size_t total = 0;
+    // gather as much of the queue as one writev can take
+    struct iovec iov[IOV_MAX];
+    int iov_count = (wrelem_.size() > IOV_MAX ? IOV_MAX : (int) wrelem_.size());
     for (int i = 0; i != iov_count; ++i) {
         iov[i].iov_base = wrelem_[i].sa.data() + wrelem_[i].pos;
         iov[i].iov_len = wrelem_[i].sa.length() - wrelem_[i].pos;
-        total += iov[i].iov_len;
+    }
+
+    // passed fds ride on the first byte of their message: send the fds
+    // due now, and stop short of the next message that carries any.
+    // Likewise stop where compression starts.
+    int nfds = 0;
+    size_t limit = size_t(-1);
+    if (!wrfds_.empty()) {
+        while (nfds != (int) wrfds_.size() && nfds != wrmaxfds
+               && wrfds_[nfds].first == wrpos_)
+            ++nfds;
+        // attach_fd() allows no more than wrmaxfds per message
+        assert(nfds == (int) wrfds_.size() || wrfds_[nfds].first > wrpos_);
+        if (nfds != (int) wrfds_.size())
+            limit = wrfds_[nfds].first - wrpos_;
+    }
+    if (wrzon_)
+        limit = std::min(limit, wrzstart_ - wrpos_);
+    if (limit != size_t(-1)) {
+        int i = 0;
+        for (; i != iov_count && limit > iov[i].iov_len; ++i)
+            limit -= iov[i].iov_len;
+        if (i != iov_count) {
+            iov[i].iov_len = limit;
+            iov_count = i + 1;
+        }
     }
 
     ssize_t amt;
-    if (iov_count > 1)
+    if (shm_)
+        amt = shm_->writev(iov, iov_count);
+    else if (nfds)
+        amt = send_fds(iov, iov_count, nfds);
+    else if (iov_count > 1)
         amt = writev(wfd_.value(), iov, iov_count);
     else
         amt = ::write(wfd_.value(), iov[0].iov_base, iov[0].iov_len);
+    if (!shm_)
+        ++wrsyscalls_;
     wrblocked_ = amt == 0 || amt == (ssize_t) -1;
 
     if (amt != 0 && amt != (ssize_t) -1) {
-        wrpos_ += amt;
-        wrsize_ -= amt;
-        while (wrelem_.size() > 1
-               && amt >= wrelem_.front().sa.length() - wrelem_.front().pos) {
-            amt -= wrelem_.front().sa.length() - wrelem_.front().pos;
-            wrelem_.pop_front();
+        for (; nfds; --nfds) {
+            close(wrfds_.front().second);
+            wrfds_.pop_front();
         }
-        wrelem_.front().pos += amt;
-        if (wrelem_.front().pos == wrelem_.front().sa.length()) {
-            assert(wrelem_.size() == 1);
-            wrelem_.front().sa.clear();
-            wrelem_.front().pos = 0;
-        }
-        while (!flushelem_.empty()
-               && (ssize_t) (wrpos_ - flushelem_.front().wpos) >= 0) {
-            flushelem_.front().e.trigger(true);
-            flushelem_.pop_front();
+        advance_write(amt);
+        finish_flushes();
+    } else
+        write_error(amt);
+}
+
+// Consume @a amt bytes from the front of the write queue.
+void msgpack_fd::advance_write(size_t amt) {
+    wrpos_ += amt;
+    wrsize_ -= amt;
+    while (wrelem_.size() > 1
+           && amt >= size_t(wrelem_.front().sa.length() - wrelem_.front().pos)) {
+        amt -= wrelem_.front().sa.length() - wrelem_.front().pos;
+        wrelem_.pop_front();
+    }
+    wrelem_.front().pos += amt;
+    if (wrelem_.front().pos == wrelem_.front().sa.length()) {
+        assert(wrelem_.size() == 1);
+        wrelem_.front().sa.clear();
+        wrelem_.front().pos = 0;
+    }
+}
+
+void msgpack_fd::finish_flushes() {
+    while (!flushelem_.empty()
+           && (ssize_t) (wrpos_ - flushelem_.front().wpos) >= 0) {
+        flushelem_.front().e.trigger(true);
+        flushelem_.pop_front();
+    }
+    if (pace_recovered())
+        pacer_();
+}
+
+void msgpack_fd::write_error(ssize_t amt) {
+    if (amt == 0)
+        wfd_.close();
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        wfd_.close(-errno);
+    check_coroutines();         // ensure coroutine is awake
+}
+
+// Compress the front of the write queue, up to zframe bytes, into one
+// frame at the end of wrzbuf_.
+void msgpack_fd::deflate_frame() {
+    wrelem& w = wrelem_.front();
+    const char* raw = w.sa.data() + w.pos;
+    size_t n = std::min(size_t(w.sa.length() - w.pos), size_t(zframe));
+    char* out = wrzbuf_.reserve(zheader + mpcompress::bound(n));
+    size_t zlen = mpcompress::compress(raw, n, out + zheader);
+    uint32_t zword = zlen;
+    if (zlen >= n) {            // incompressible: store it
+        memcpy(out + zheader, raw, n);
+        zlen = n;
+        zword = n | 0x80000000U;
+    }
+    write_in_net_order<uint32_t>(out, zword);
+    write_in_net_order<uint32_t>(out + 4, n);
+    wrzbuf_.adjust_length(zheader + zlen);
+    wrzraw_ += n;
+    wrzout_ += zheader + zlen;
+    advance_write(n);
+}
+
+// Write compressed frames. A batch of frames is built from the queue
+// once the previous batch has been written; flushes complete when the
+// frames holding their data have left.
+void msgpack_fd::write_compressed() {
+    if (wrzpos_ == size_t(wrzbuf_.length())) {
+        wrzbuf_.clear();
+        wrzpos_ = 0;
+        uint64_t t0 = clock_ns();
+        while (wrsize_ && wrzbuf_.length() < wrcap)
+            deflate_frame();
+        wrzns_ += clock_ns() - t0;
+    }
+    if (wrzpos_ == size_t(wrzbuf_.length()))
+        return;
+
+    struct iovec iov;
+    iov.iov_base = wrzbuf_.data() + wrzpos_;
+    iov.iov_len = wrzbuf_.length() - wrzpos_;
+    ssize_t amt;
+    if (shm_)
+        amt = shm_->writev(&iov, 1);
+    else {
+        amt = ::write(wfd_.value(), iov.iov_base, iov.iov_len);
+        ++wrsyscalls_;
+    }
+    wrblocked_ = amt == 0 || amt == (ssize_t) -1;
+
+    if (amt != 0 && amt != (ssize_t) -1) {
+        wrzpos_ += amt;
+        if (wrzpos_ == size_t(wrzbuf_.length()))
+            finish_flushes();
+    } else
+        write_error(amt);
+}
+
+// Give back a write buffer that has seen no traffic for idle_msec. The
+// next message reallocates it at the minimum size.
+void msgpack_fd::release_idle_buffers() {
+    double idle_before = tamer::drecent() - idle_msec / 1000.0;
+    if (wrelem_.size() == 1 && wrelem_.front().sa.empty()
+        && wrelem_.front().sa.capacity() && wrlast_ <= idle_before) {
+        wrelem_.front().sa = StringAccum();
+        if (wrzpos_ == size_t(wrzbuf_.length())) {
+            wrzbuf_ = StringAccum();
+            wrzpos_ = 0;
         }
-        if (pace_recovered())
-            pacer_();
-    } else {
-        if (amt == 0)
-            wfd_.close();
-        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
-            wfd_.close(-errno);
-        check_coroutines();     // ensure coroutine is awake
     }
 }
 
@@ -331,12 +1059,29 @@ tamed void msgpack_fd::writer_coroutine() {
     kill = wrkill_ = tamer::make_event(rendez);
 
     while (kill && wfd_) {
-        if (wrelem_.size() == 1 && wrelem_.front().sa.empty())
+        if (write_idle() && wrelem_.front().sa.capacity()) {
+            wrdelayed_ = false;
+            twait {
+                wrwake_ = tamer::add_timeout(idle_msec / 1000.0, make_event());
+            }
+            if (kill)
+                release_idle_buffers();
+        } else if (write_idle()) {
+            wrdelayed_ = false;
             twait { wrwake_ = make_event(); }
-        else if (wrblocked_) {
+        } else if (wrblocked_ && shm_) {
+            // a full ring signals space by making its eventfd readable
+            twait { tamer::at_fd_read(wfd_.value(), make_event()); }
+            if (kill)
+                wrblocked_ = false;
+        } else if (wrblocked_) {
             twait { tamer::at_fd_write(wfd_.value(), make_event()); }
             if (kill)
                 wrblocked_ = false;
+        } else if (wrdelay_ > 0 && !wrdelayed_ && wrsize_ < size_t(wrcap)) {
+            // hold the batch open for more messages
+            wrdelayed_ = true;
+            twait { tamer::at_delay(wrdelay_, make_event()); }
         } else
             write_once();
     }
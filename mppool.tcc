@@ -0,0 +1,235 @@
+// -*- mode: c++ -*-
+#include "mppool.hh"
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <unordered_map>
+
+namespace {
+enum { default_connections = 4, default_load = 64 };
+const double backoff_min = 0.05, backoff_max = 5;
+
+bool lookup_host(const String& host, struct in_addr& addr) {
+    in_addr_t a = inet_addr(host.c_str());
+    if (a != INADDR_NONE) {
+        addr.s_addr = a;
+        return true;
+    }
+    struct hostent* hp = gethostbyname(host.c_str());
+    if (hp == NULL || hp->h_length != 4 || hp->h_addrtype != AF_INET)
+        return false;
+    addr = *((struct in_addr*) hp->h_addr);
+    return true;
+}
+}
+
+msgpack_pool::msgpack_pool(const String& host, int port)
+    : host_(host), port_(port), maxconn_(default_connections),
+      growload_(default_load), timeout_(0), nconnects_(0), nfailures_(0),
+      backoff_(0), retry_at_(0) {
+}
+
+msgpack_pool::~msgpack_pool() {
+    for (auto& s : slots_)
+        s->kill();
+    for (auto& c : queue_)
+        c.reply.unblock();
+}
+
+/** @brief Return the process-wide pool for @a host and @a port.
+
+    Pools are per process, like the event loop their connections run
+    on. */
+msgpack_pool& msgpack_pool::get(const String& host, int port) {
+    static std::unordered_map<String, std::unique_ptr<msgpack_pool> > pools;
+    std::unique_ptr<msgpack_pool>& p = pools[host + ":" + String(port)];
+    if (!p)
+        p.reset(new msgpack_pool(host, port));
+    return *p;
+}
+
+/** @brief Send the call @a j on some connection and deliver its reply to
+    @a done.
+
+    @a j[1] must be null; each connection numbers its own calls. @a done
+    receives a null Json if the call's connection fails first. */
+void msgpack_pool::call(const Json& j, tamer::event<Json> done) {
+    assert(j.is_a() && j[1].is_null());
+    send(pending_call{j, false, 0, std::move(done)});
+}
+
+/** @brief Send the call @a j with a deadline @a timeout seconds away.
+
+    The deadline starts when the call leaves the queue. See
+    msgpack_fd::call(). */
+void msgpack_pool::call(const Json& j, double timeout,
+                        tamer::event<Json> done) {
+    assert(j.is_a() && j[1].is_null());
+    send(pending_call{j, true, timeout, std::move(done)});
+}
+
+void msgpack_pool::send(pending_call c) {
+    if (slot* s = pick())
+        dispatch(s, c);
+    else if (connecting())
+        queue_.push_back(std::move(c));
+    else
+        c.reply.trigger(Json());
+}
+
+// Return the live connection with the fewest outstanding calls, or null.
+// Opens another connection if that one is busy.
+auto msgpack_pool::pick() -> slot* {
+    slot* best = 0;
+    for (auto& s : slots_)
+        if (s->mpfd && (!best || s->mpfd.outstanding_calls()
+                                 < best->mpfd.outstanding_calls()))
+            best = s.get();
+    if (!best || best->mpfd.outstanding_calls() >= growload_)
+        grow();
+    return best;
+}
+
+bool msgpack_pool::connecting() const {
+    for (auto& s : slots_)
+        if (s->connecting)
+            return true;
+    return false;
+}
+
+void msgpack_pool::grow() {
+    if (connecting() || tamer::drecent() < retry_at_)
+        return;
+    slot* s = 0;
+    for (auto& sp : slots_)
+        if (!sp->mpfd) {
+            s = sp.get();
+            break;
+        }
+    if (!s && int(slots_.size()) < maxconn_) {
+        slots_.emplace_back(new slot());
+        s = slots_.back().get();
+    }
+    if (s) {
+        // keep the failed connection's latencies before reusing its slot
+        retired_latency_.merge(s->mpfd.call_latency());
+        s->mpfd.clear();
+        s->mpfd.reset_call_latency();
+        s->connecting = true;
+        connect(s);
+    }
+}
+
+void msgpack_pool::drain_queue() {
+    while (!queue_.empty()) {
+        slot* s = pick();
+        if (!s)
+            break;
+        pending_call c = std::move(queue_.front());
+        queue_.pop_front();
+        dispatch(s, c);
+    }
+}
+
+tamed void msgpack_pool::connect(slot* s) {
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        struct in_addr addr;
+        tamer::fd cfd;
+    }
+
+    kill = s->kill = tamer::make_event(rendez);
+    if (lookup_host(host_, addr))
+        twait { tamer::tcp_connect(addr, port_, make_event(cfd)); }
+    if (!kill) {                // pool destroyed
+        cfd.close();
+        return;
+    }
+
+    s->connecting = false;
+    if (cfd) {
+        ++nconnects_;
+        backoff_ = 0;
+        s->mpfd.set_call_timeout(timeout_);
+        s->mpfd.set_cancel_method(cancel_);
+        s->mpfd.initialize(cfd);
+    } else {
+        ++nfailures_;
+        retry_at_ = tamer::drecent()
+            + std::min(backoff_min * (1 << std::min(backoff_, 10)), backoff_max);
+        ++backoff_;
+    }
+    if (live_connections())
+        drain_queue();
+    else
+        while (!queue_.empty()) {
+            queue_.front().reply.trigger(Json());
+            queue_.pop_front();
+        }
+    kill();
+}
+
+/** @brief Set the default call timeout of every connection.
+
+    See msgpack_fd::set_call_timeout(). */
+void msgpack_pool::set_call_timeout(double timeout) {
+    timeout_ = timeout;
+    for (auto& s : slots_)
+        s->mpfd.set_call_timeout(timeout);
+}
+
+/** @brief Set the cancel method of every connection.
+
+    See msgpack_fd::set_cancel_method(). */
+void msgpack_pool::set_cancel_method(const Json& method) {
+    cancel_ = method;
+    for (auto& s : slots_)
+        s->mpfd.set_cancel_method(method);
+}
+
+int msgpack_pool::live_connections() const {
+    int n = 0;
+    for (auto& s : slots_)
+        n += bool(s->mpfd);
+    return n;
+}
+
+/** @brief Return the number of calls not yet answered: those queued for
+    a connection plus those outstanding on one. */
+size_t msgpack_pool::queue_depth() const {
+    size_t n = queue_.size();
+    for (auto& s : slots_)
+        n += s->mpfd.outstanding_calls();
+    return n;
+}
+
+/** @brief Return the call latencies of all the pool's connections, past
+    and present. */
+latency_histogram msgpack_pool::call_latency() const {
+    latency_histogram h = retired_latency_;
+    for (auto& s : slots_)
+        h.merge(s->mpfd.call_latency());
+    return h;
+}
+
+Json msgpack_pool::status() const {
+    latency_histogram h = call_latency();
+    size_t timed_out = 0;
+    for (auto& s : slots_)
+        timed_out += s->mpfd.timed_out_calls();
+    Json j = Json().set("host", host_)
+        .set("port", port_)
+        .set("connections", live_connections())
+        .set("connecting", connecting())
+        .set("queued_calls", queue_.size())
+        .set("queue_depth", queue_depth())
+        .set("connects", nconnects_)
+        .set("connect_failures", nfailures_)
+        .set("calls_timed_out", timed_out);
+    if (h.count())
+        j.set("calls_completed", h.count())
+            .set("call_p50_us", h.percentile(0.5) / 1000.0)
+            .set("call_p99_us", h.percentile(0.99) / 1000.0)
+            .set("call_p999_us", h.percentile(0.999) / 1000.0);
+    return j;
+}
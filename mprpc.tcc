@@ -1,56 +1,577 @@
 // -*- mode: c++ -*-
 #include "clp.h"
 #include "mpfd.hh"
+#include "mpuring.hh"
+#include "mpshm.hh"
+#include "mppool.hh"
 #include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 static bool quiet = false;
-tamed void handle_client(tamer::fd cfd);
+static int worker_index = -1;
+static unsigned long n_accepted = 0;
+static unsigned long n_rpcs = 0;
+static unsigned long n_rejected = 0;
+static unsigned long payload_sum = 0;
+static String unix_path;
+static int max_inflight = 64;
+static double slow_delay = 0;
+static int slow_every = 100;
+static bool coalesce = false;
+static bool compress = false;
+static double flush_delay = 0;
+static long max_message = 0;
+static long chunk_threshold = 0;
+enum { shm_capacity = 1 << 20, max_queued = 1024 };
+tamed void handle_client(tamer::fd cfd, bool fdpass);
 
-tamed void server(int port) {
-    tvars {
-        tamer::fd sfd = tamer::tcp_listen(port);
-        tamer::fd cfd;
+// Listen on `port` with SO_REUSEPORT set, so that several worker
+// processes can each own a listener and let the kernel shard incoming
+// connections among them.
+static tamer::fd tcp_listen_reuseport(int port) {
+    int f = socket(AF_INET, SOCK_STREAM, 0);
+    if (f < 0)
+        return tamer::fd(-errno);
+    int yes = 1;
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(f, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0
+#ifdef SO_REUSEPORT
+        || setsockopt(f, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0
+#endif
+        || fcntl(f, F_SETFL, O_NONBLOCK) < 0
+        || bind(f, (struct sockaddr*) &sin, sizeof(sin)) < 0
+        || listen(f, 128) < 0) {
+        int err = -errno;
+        close(f);
+        return tamer::fd(err);
     }
-    if (sfd)
-        std::cerr << "listening on port " << port << std::endl;
-    else
-        std::cerr << "listen: " << strerror(-sfd.error()) << std::endl;
+    return tamer::fd(f);
+}
+
+static int unix_address(const char* path, struct sockaddr_un& sun) {
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(sun.sun_path, path);
+    return 0;
+}
+
+// Listen on the Unix-domain socket `path`, replacing any stale socket
+// file. Returns a raw descriptor so that forked workers can share it.
+static int unix_listen(const char* path) {
+    struct sockaddr_un sun;
+    int r = unix_address(path, sun);
+    if (r < 0)
+        return r;
+    int f = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (f < 0)
+        return -errno;
+    unlink(path);
+    if (fcntl(f, F_SETFL, O_NONBLOCK) < 0
+        || bind(f, (struct sockaddr*) &sun, sizeof(sun)) < 0
+        || listen(f, 128) < 0) {
+        int err = -errno;
+        close(f);
+        return err;
+    }
+    return f;
+}
+
+// Connecting to a listening Unix-domain socket completes immediately.
+static tamer::fd unix_connect(const char* path) {
+    struct sockaddr_un sun;
+    int r = unix_address(path, sun);
+    if (r < 0)
+        return tamer::fd(r);
+    int f = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (f < 0)
+        return tamer::fd(-errno);
+    if (connect(f, (struct sockaddr*) &sun, sizeof(sun)) < 0
+        || fcntl(f, F_SETFL, O_NONBLOCK) < 0) {
+        int err = -errno;
+        close(f);
+        return tamer::fd(err);
+    }
+    return tamer::fd(f);
+}
+
+static std::ostream& worker_prefix(std::ostream& str) {
+    if (worker_index >= 0)
+        str << "worker " << worker_index << " [" << getpid() << "]: ";
+    return str;
+}
+
+tamed void accept_loop(tamer::fd sfd, bool fdpass) {
+    tvars { tamer::fd cfd; }
     while (sfd) {
         twait { sfd.accept(make_event(cfd)); }
-        handle_client(cfd);
+        if (cfd)
+            ++n_accepted;
+        handle_client(cfd, fdpass);
+    }
+}
+
+void server(int port, bool reuseport) {
+    tamer::fd sfd = reuseport ? tcp_listen_reuseport(port)
+                              : tamer::tcp_listen(port);
+    if (sfd)
+        worker_prefix(std::cerr) << "listening on port " << port << std::endl;
+    else
+        worker_prefix(std::cerr) << "listen: " << strerror(-sfd.error()) << std::endl;
+    accept_loop(sfd, false);
+}
+
+void unix_server(int ufd) {
+    worker_prefix(std::cerr) << "listening on " << unix_path << std::endl;
+    accept_loop(tamer::fd(ufd), true);
+}
+
+tamed void server_report(int signo) {
+    twait { tamer::at_signal(signo, make_event()); }
+    worker_prefix(std::cerr) << n_accepted << " connections accepted, "
+                             << n_rpcs << " RPCs handled, "
+                             << n_rejected << " messages rejected" << std::endl;
+    if (uring_driver* ring = uring_driver::get())
+        worker_prefix(std::cerr) << "io_uring: " << ring->status() << std::endl;
+    exit(0);
+}
+
+static void write_reply(msgpack_fd& mpfd, const msgpack::view& req) {
+    mpfd.write_with([&](msgpack::unparser<StringAccum>& mu) {
+            mu << msgpack::array(2) << -req[0].as_i() << req[1];
+        });
+}
+
+// Method 2 passes its payload as a memfd. Map it and read it through, as
+// a handler using the payload would, so that memfd calls do the same
+// work as calls whose payload arrives inline.
+static void read_payload_memfd(int pfd) {
+    struct stat st;
+    if (fstat(pfd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, pfd, 0);
+        if (p != MAP_FAILED) {
+            const unsigned char* s = reinterpret_cast<unsigned char*>(p);
+            unsigned long sum = 0;
+            for (off_t i = 0; i != st.st_size; ++i)
+                sum += s[i];
+            payload_sum += sum;
+            munmap(p, st.st_size);
+        }
+    }
+    close(pfd);
+}
+
+tamed void handle_shm_client(shm_channel* ch);
+
+// Method 3 hands over a shared-memory channel made by the client. The
+// reply says whether the server attached it.
+static void accept_shm(msgpack_fd& mpfd, const msgpack::view& req) {
+    int fds[shm_channel::nfds];
+    int n = 0;
+    while (n != shm_channel::nfds && (fds[n] = mpfd.take_fd()) >= 0)
+        ++n;
+    shm_channel* ch = 0;
+    if (n == shm_channel::nfds && !(ch = shm_channel::attach(fds)))
+        std::cerr << "shm: " << strerror(errno) << std::endl;
+    if (!ch)
+        for (int i = 0; i != n; ++i)
+            close(fds[i]);
+    mpfd.write_with([&](msgpack::unparser<StringAccum>& mu) {
+            mu << msgpack::array(3) << -req[0].as_i() << req[1]
+               << Json(ch != 0);
+        });
+    if (ch)
+        handle_shm_client(ch);
+}
+
+// Requests in flight on one connection. Handlers that must wait run as
+// their own coroutines, at most `max_inflight` at a time, and reply as
+// they finish, so one slow request does not hold up the rest. While the
+// window is full, new calls queue in order behind it, and reading
+// continues so cancels for running or queued calls still arrive. Once
+// `max_queued` calls wait, reading stops until the window moves.
+struct dispatch_window {
+    int inflight;
+    tamer::event<> wake;
+    std::unordered_map<int64_t, tamer::event<> > waiting;
+    std::deque<std::pair<msgpack::view, bool> > queued;
+    std::unordered_set<int64_t> queued_seqs;
+
+    bool full() const {
+        return queued_seqs.size() >= size_t(max_queued);
+    }
+};
+
+tamed void slow_request(msgpack_fd& mpfd, msgpack::view req,
+                        dispatch_window& w);
+
+static bool in_window(const dispatch_window& w, int64_t seq) {
+    return w.waiting.count(seq) || w.queued_seqs.count(seq);
+}
+
+static void start_request(msgpack_fd& mpfd, const msgpack::view& req,
+                          bool slow, dispatch_window& w) {
+    if (slow) {
+        ++w.inflight;
+        slow_request(mpfd, req, w);
+    } else
+        write_reply(mpfd, req);
+}
+
+// Dispatch `req` now, or queue it behind a full window. The caller
+// stops reading while the queue is full.
+static void dispatch_request(msgpack_fd& mpfd, const msgpack::view& req,
+                             bool slow, dispatch_window& w) {
+    if (w.inflight < max_inflight && w.queued.empty())
+        start_request(mpfd, req, slow, w);
+    else {
+        assert(!w.full());
+        w.queued.push_back(std::make_pair(req, slow));
+        w.queued_seqs.insert(req[1].as_i());
+    }
+}
+
+// A synthetic slow handler: wait `slow_delay` seconds, unless the client
+// cancels the call first, then reply. A finished handler lets queued
+// calls into the window.
+tamed void slow_request(msgpack_fd& mpfd, msgpack::view req,
+                        dispatch_window& w) {
+    tvars { int64_t seq; }
+    seq = req[1].as_i();
+    twait { w.waiting[seq] = tamer::add_timeout(slow_delay, make_event()); }
+    if (w.waiting.erase(seq))
+        write_reply(mpfd, req);
+    --w.inflight;
+    while (!w.queued.empty() && w.inflight < max_inflight && mpfd) {
+        std::pair<msgpack::view, bool> q = w.queued.front();
+        w.queued.pop_front();
+        w.queued_seqs.erase(q.first[1].as_i());
+        start_request(mpfd, q.first, q.second, w);
+    }
+    w.wake();
+}
+
+static void cancel_request(dispatch_window& w, int64_t seq) {
+    auto it = w.waiting.find(seq);
+    if (it != w.waiting.end()) {
+        tamer::event<> e = std::move(it->second);
+        w.waiting.erase(it);
+        e();
+        return;
     }
+    if (w.queued_seqs.erase(seq))
+        for (auto qit = w.queued.begin(); qit != w.queued.end(); ++qit)
+            if (qit->first[1].as_i() == seq) {
+                w.queued.erase(qit);
+                return;
+            }
 }
 
-tamed void handle_client(tamer::fd cfd) {
+tamed void handle_requests(msgpack_fd& mpfd, tamer::event<> done) {
     tvars {
-        msgpack_fd mpfd(cfd);
-        Json req, res = Json::make_array();
+        msgpack::view req;
+        int pfd;
+        String chunk;
+        dispatch_window w;
     }
 
-    while (cfd) {
+    w.inflight = 0;
+    while (mpfd) {
+        // a client not reading its replies, or with a full queue of
+        // calls behind the window, stops further reads
+        twait { mpfd.pace(make_event()); }
+        while (w.full() && mpfd)
+            twait { w.wake = make_event(); }
+
         twait { mpfd.read_request(make_event(req)); }
-        if (!req || !req.is_a() || req.size() < 2 || !req[0].is_i()) {
+        if (!req || !req.is_a() || req.size() < 2 || !req[0].is_i()
+            || !req[1].is_i()) {
             if (req)
                 std::cerr << "bad RPC: " << req << std::endl;
             break;
         }
 
-        res[0] = -req[0].as_i();
-        res[1] = req[1];
-        mpfd.write(res);
+        // a large payload follows its request in chunks; this server
+        // only needs to consume it
+        while (mpfd.payload_remaining())
+            twait { mpfd.read_payload(make_event(chunk)); }
+
+        if (req[0].as_i() == 2 && (pfd = mpfd.take_fd()) >= 0)
+            read_payload_memfd(pfd);
+
+        // method 4 cancels a timed-out call and gets no reply; a request
+        // reusing the seq of a call still in the window resets the
+        // connection, since its reply could not be told apart from the
+        // earlier call's
+        if (req[0].as_i() == 3)
+            accept_shm(mpfd, req);
+        else if (req[0].as_i() == 4)
+            cancel_request(w, req[1].as_i());
+        else if (in_window(w, req[1].as_i())) {
+            ++n_rejected;
+            break;
+        } else
+            dispatch_request(mpfd, req,
+                             slow_delay > 0 && n_rpcs % slow_every == 0, w);
+        ++n_rpcs;
     }
 
+    // abandon handlers for a closed connection
+    w.queued.clear();
+    w.queued_seqs.clear();
+    while (!w.waiting.empty())
+        cancel_request(w, w.waiting.begin()->first);
+    while (w.inflight)
+        twait { w.wake = make_event(); }
+    done();
+}
+
+static void configure_server_fd(msgpack_fd& mpfd) {
+    mpfd.set_coalescing(coalesce, flush_delay);
+    mpfd.set_compression(compress);
+    if (max_message > 0)
+        mpfd.set_max_message_size(max_message);
+    mpfd.set_payload_threshold(chunk_threshold);
+}
+
+tamed void handle_client(tamer::fd cfd, bool fdpass) {
+    tvars { msgpack_fd mpfd; }
+    mpfd.set_fd_passing(fdpass);
+    configure_server_fd(mpfd);
+    mpfd.initialize(cfd);
+    twait { handle_requests(mpfd, make_event()); }
+    n_rejected += mpfd.rejected_messages();
     cfd.close();
 }
 
+tamed void handle_shm_client(shm_channel* ch) {
+    tvars { msgpack_fd mpfd; }
+    configure_server_fd(mpfd);
+    mpfd.initialize(ch);
+    twait { handle_requests(mpfd, make_event()); }
+    n_rejected += mpfd.rejected_messages();
+}
+
+
+enum transport { tcp_transport, unix_transport, shm_transport };
+
+struct load_options {
+    long nrequests;
+    int window;
+    int payload;
+    bool memfd;
+    bool shm;
+    bool compare;
+    double timeout;
+    int pool;
+};
+
+static double dnow() {
+    struct timeval tv = tamer::now();
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = size_t(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// Returns a sealed memfd holding `size` bytes of payload, or -errno.
+static int make_payload_memfd(int size) {
+#if !HAVE_MEMFD_CREATE
+    (void) size;
+    return -ENOSYS;
+#else
+    int f = memfd_create("mprpc-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (f < 0)
+        return -errno;
+    String payload = String::make_fill('x', size);
+    if (write(f, payload.data(), size) != size
+        || fcntl(f, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) < 0) {
+        int err = errno ? -errno : -EIO;
+        close(f);
+        return err;
+    }
+    return f;
+#endif
+}
+
+static void load_report(const char* label, std::vector<double>& latencies,
+                        long nerrors, double elapsed) {
+    std::sort(latencies.begin(), latencies.end());
+    std::cout.precision(3);
+    std::cout << std::fixed << label << ": " << latencies.size() << " calls, "
+              << nerrors << " errors, " << elapsed << " s, "
+              << (elapsed > 0 ? latencies.size() / elapsed : 0.) << " calls/s\n"
+              << "latency us: p50 " << percentile(latencies, 0.5) * 1e6
+              << ", p90 " << percentile(latencies, 0.9) * 1e6
+              << ", p99 " << percentile(latencies, 0.99) * 1e6
+              << ", p99.9 " << percentile(latencies, 0.999) * 1e6
+              << ", max " << percentile(latencies, 1) * 1e6 << std::endl;
+}
+
+tamed void load_call(msgpack_fd& mpfd, Json req, int payload_fd,
+                     std::vector<double>& latencies, long& nerrors,
+                     tamer::event<> done) {
+    tvars {
+        double start = dnow();
+        Json res;
+    }
+    if (payload_fd >= 0)
+        mpfd.attach_fd(dup(payload_fd));
+    twait { mpfd.call(req, make_event(res)); }
+    if (res.is_a())
+        latencies.push_back(dnow() - start);
+    else
+        ++nerrors;
+    done();
+}
+
+// Keep up to `opt.window` calls outstanding until `opt.nrequests` calls
+// complete, then report throughput and latency percentiles. With `memfd`,
+// each call passes its payload as a memfd rather than inline.
+tamed void load(const char* label, msgpack_fd& mpfd, bool memfd,
+                load_options opt, tamer::event<> done) {
+    tvars {
+        tamer::rendezvous<> rendez;
+        Json req;
+        int payload_fd = -1;
+        std::vector<double> latencies;
+        long i, nerrors = 0;
+        int nout = 0;
+        double start;
+    }
+    if (memfd) {
+        payload_fd = make_payload_memfd(opt.payload);
+        if (payload_fd < 0) {
+            std::cerr << "memfd: " << strerror(-payload_fd) << std::endl;
+            done();
+            return;
+        }
+        req = Json::array(2, Json(), opt.payload);
+    } else
+        req = Json::array(1, Json(), String::make_fill('x', opt.payload));
+    mpfd.set_coalescing(coalesce, flush_delay);
+    if (opt.timeout > 0) {
+        mpfd.set_call_timeout(opt.timeout);
+        mpfd.set_cancel_method(4);
+    }
+    latencies.reserve(opt.nrequests);
+    start = dnow();
+    for (i = 0; i != opt.nrequests && mpfd; ++i) {
+        if (nout == opt.window) {
+            twait(rendez);
+            --nout;
+        }
+        twait { mpfd.pace(make_event()); }
+        load_call(mpfd, req, payload_fd, latencies, nerrors,
+                  make_event(rendez));
+        ++nout;
+    }
+    while (nout) {
+        twait(rendez);
+        --nout;
+    }
+    load_report(label, latencies, nerrors, dnow() - start);
+    if (opt.timeout > 0)
+        std::cout << label << ": " << mpfd.timed_out_calls() << " timed out, "
+                  << mpfd.late_replies() << " late replies" << std::endl;
+    std::cout << label << ": " << mpfd.sent_messages() << " messages in "
+              << mpfd.write_syscalls() << " writes" << std::endl;
+    if (mpfd.compressing()) {
+        Json st = mpfd.status();
+        std::cout << label << ": compressed " << st["compress_ratio"].to_d()
+                  << "x in " << st["compress_ms"].to_d() << " ms, "
+                  << "decompressed " << st["decompress_ratio"].to_d()
+                  << "x in " << st["decompress_ms"].to_d() << " ms" << std::endl;
+    }
+    if (payload_fd >= 0)
+        close(payload_fd);
+    done();
+}
+
+tamed void pool_call(msgpack_pool& pool, Json req,
+                     std::vector<double>& latencies, long& nerrors,
+                     tamer::event<> done) {
+    tvars {
+        double start = dnow();
+        Json res;
+    }
+    twait { pool.call(req, make_event(res)); }
+    if (res.is_a())
+        latencies.push_back(dnow() - start);
+    else
+        ++nerrors;
+    done();
+}
+
+// Like load(), but spread the calls over a pool of up to `opt.pool`
+// connections, as a service with many callers would.
+tamed void pool_load(const char* hostname, int port, load_options opt,
+                     tamer::event<> done) {
+    tvars {
+        msgpack_pool* pool;
+        tamer::rendezvous<> rendez;
+        Json req;
+        std::vector<double> latencies;
+        long i, nerrors = 0;
+        int nout = 0;
+        size_t maxdepth = 0;
+        double start;
+    }
+    pool = &msgpack_pool::get(hostname, port);
+    pool->set_max_connections(opt.pool);
+    pool->set_connection_load(std::max(opt.window / opt.pool, 1));
+    if (opt.timeout > 0) {
+        pool->set_call_timeout(opt.timeout);
+        pool->set_cancel_method(4);
+    }
+    req = Json::array(1, Json(), String::make_fill('x', opt.payload));
+    latencies.reserve(opt.nrequests);
+    start = dnow();
+    for (i = 0; i != opt.nrequests; ++i) {
+        if (nout == opt.window) {
+            twait(rendez);
+            --nout;
+        }
+        pool_call(*pool, req, latencies, nerrors, make_event(rendez));
+        ++nout;
+        maxdepth = std::max(maxdepth, pool->queue_depth());
+    }
+    while (nout) {
+        twait(rendez);
+        --nout;
+    }
+    load_report("pool", latencies, nerrors, dnow() - start);
+    std::cout << "pool: " << pool->status().set("max_queue_depth", maxdepth)
+              << std::endl;
+    done();
+}
 
-tamed void client(const char* hostname, int port) {
+tamed void tcp_client_connect(const char* hostname, int port,
+                              tamer::event<tamer::fd> done) {
     tvars {
         tamer::fd cfd;
-        msgpack_fd mpfd;
         struct in_addr hostip;
-        int i;
-        Json req, res;
     }
 
     // lookup hostname address
@@ -62,6 +583,7 @@ tamed void client(const char* hostname, int port) {
             struct hostent* hp = gethostbyname(hostname);
             if (hp == NULL || hp->h_length != 4 || hp->h_addrtype != AF_INET) {
                 std::cerr << "lookup " << hostname << ": " << hstrerror(h_errno) << std::endl;
+                done(tamer::fd());
                 return;
             }
             hostip = *((struct in_addr*) hp->h_addr);
@@ -70,15 +592,116 @@ tamed void client(const char* hostname, int port) {
 
     // connect
     twait { tamer::tcp_connect(hostip, port, make_event(cfd)); }
-    if (!cfd) {
+    if (!cfd)
         std::cerr << "connect " << (hostname ? hostname : "localhost")
                   << ":" << port << ": " << strerror(-cfd.error()) << std::endl;
+    done(cfd);
+}
+
+// Create a shared-memory channel, pass it to the server over the
+// Unix-domain connection `cfd`, and once the server accepts, run `mpfd`
+// over the channel. The socket is closed after the handoff.
+tamed void shm_connect(tamer::fd cfd, msgpack_fd& mpfd, tamer::event<> done) {
+    tvars {
+        msgpack_fd handoff;
+        shm_channel* ch;
+        Json res;
+        int i;
+    }
+    handoff.initialize(cfd);
+    ch = shm_channel::create(shm_capacity);
+    if (!ch) {
+        std::cerr << "shm: " << strerror(errno) << std::endl;
+        cfd.close();
+        done();
         return;
     }
-    mpfd.initialize(cfd);
+    for (i = 0; i != shm_channel::nfds; ++i)
+        handoff.attach_fd(dup(ch->fds()[i]));
+    twait { handoff.call(Json::array(3, Json()), make_event(res)); }
+    if (res[2].as_b(false))
+        mpfd.initialize(ch);
+    else {
+        std::cerr << "shm: server refused channel" << std::endl;
+        delete ch;
+    }
+    cfd.close();
+    done();
+}
+
+tamed void client_connect(const char* hostname, int port, transport t,
+                          msgpack_fd& mpfd, tamer::event<> done) {
+    tvars { tamer::fd cfd; }
+    if (t != tcp_transport) {
+        cfd = unix_connect(unix_path.c_str());
+        if (!cfd)
+            std::cerr << "connect " << unix_path << ": "
+                      << strerror(-cfd.error()) << std::endl;
+    } else
+        twait { tcp_client_connect(hostname, port, make_event(cfd)); }
+    mpfd.set_compression(compress);
+    if (cfd && t == shm_transport)
+        twait { shm_connect(cfd, mpfd, make_event()); }
+    else if (cfd)
+        mpfd.initialize(cfd);
+    done();
+}
+
+tamed void run_load(const char* label, const char* hostname, int port,
+                    transport t, bool memfd, load_options opt,
+                    tamer::event<> done) {
+    tvars { msgpack_fd mpfd; }
+    twait { client_connect(hostname, port, t, mpfd, make_event()); }
+    if (mpfd)
+        twait { load(label, mpfd, memfd, opt, make_event()); }
+    done();
+}
+
+// Run the same load over TCP loopback, the Unix-domain socket, the
+// Unix-domain socket with memfd payloads (for nonempty payloads), and a
+// shared-memory channel.
+tamed void compare(const char* hostname, int port, load_options opt) {
+    twait { run_load("tcp", hostname, port, tcp_transport, false, opt,
+                     make_event()); }
+    twait { run_load("unix", hostname, port, unix_transport, false, opt,
+                     make_event()); }
+    if (opt.payload > 0)
+        twait { run_load("unix+memfd", hostname, port, unix_transport, true,
+                         opt, make_event()); }
+    twait { run_load("shm", hostname, port, shm_transport, false, opt,
+                     make_event()); }
+}
+
+tamed void client(const char* hostname, int port, load_options opt) {
+    tvars {
+        transport t;
+        msgpack_fd mpfd;
+        int i;
+        Json req, res;
+    }
+
+    if (opt.shm)
+        t = shm_transport;
+    else
+        t = unix_path.empty() ? tcp_transport : unix_transport;
+
+    // pipelined load
+    if (opt.nrequests > 0 && opt.pool > 0) {
+        twait { pool_load(hostname, port, opt, make_event()); }
+        return;
+    } else if (opt.nrequests > 0) {
+        twait {
+            run_load(opt.shm ? "shm" : unix_path.empty() ? "tcp"
+                     : (opt.memfd ? "unix+memfd" : "unix"),
+                     hostname, port, t, opt.memfd, opt, make_event());
+        }
+        return;
+    }
+
+    twait { client_connect(hostname, port, t, mpfd, make_event()); }
 
     // pingpong 10 times
-    for (i = 0; i != 10 && cfd; ++i) {
+    for (i = 0; i != 10 && mpfd; ++i) {
         req = Json::array(1, i);
         twait { mpfd.call(req, make_event(res)); }
         if (!quiet)
@@ -86,7 +709,7 @@ tamed void client(const char* hostname, int port) {
     }
 
     // close out
-    cfd.close();
+    mpfd.clear();
 }
 
 
@@ -95,15 +718,77 @@ static Clp_Option options[] = {
     { "listen", 'l', 0, 0, 0 },
     { "port", 'p', 0, Clp_ValInt, 0 },
     { "host", 'h', 0, Clp_ValString, 0 },
-    { "quiet", 'q', 0, 0, Clp_Negate }
+    { "quiet", 'q', 0, 0, Clp_Negate },
+    { "threads", 'j', 0, Clp_ValInt, 0 },
+    { "requests", 'n', 0, Clp_ValInt, 0 },
+    { "window", 'w', 0, Clp_ValInt, 0 },
+    { "payload", 's', 0, Clp_ValInt, 0 },
+    { "unix", 'u', 0, Clp_ValString, 0 },
+    { "memfd", 0, 0, 0, Clp_Negate },
+    { "shm", 0, 0, 0, Clp_Negate },
+    { "timeout", 't', 0, Clp_ValDouble, 0 },
+    { "inflight", 0, 0, Clp_ValInt, 0 },
+    { "coalesce", 0, 0, 0, Clp_Negate },
+    { "compress", 0, 0, 0, Clp_Negate },
+    { "flush-delay", 0, 0, Clp_ValDouble, 0 },
+    { "slow", 0, 0, Clp_ValDouble, 0 },
+    { "slow-every", 0, 0, Clp_ValInt, 0 },
+    { "max-message", 0, 0, Clp_ValInt, 0 },
+    { "chunk", 0, 0, Clp_ValInt, 0 },
+    { "pool", 0, 0, Clp_ValInt, 0 },
+    { "compare", 0, 0, 0, 0 }
 };
 
-int main(int argc, char** argv) {
+static void serve(int port, bool reuseport, int ufd) {
     tamer::initialize();
+    server(port, reuseport);
+    if (ufd >= 0)
+        unix_server(ufd);
+    server_report(SIGINT);
+    server_report(SIGTERM);
+    tamer::loop();
+    tamer::cleanup();
+}
+
+static std::vector<pid_t> worker_pids;
+
+static void kill_workers(int signo) {
+    for (pid_t p : worker_pids)
+        kill(p, signo);
+}
+
+// Run `nworkers` independent event loops. tamer's driver and String's
+// reference counts are per-process and unsynchronized, so each loop gets
+// its own process and its own SO_REUSEPORT listener; nothing is shared on
+// the request path.
+static void serve_workers(int nworkers, int port, int ufd) {
+    for (int i = 0; i != nworkers; ++i) {
+        pid_t p = fork();
+        if (p == 0) {
+            worker_index = i;
+            serve(port, true, ufd);
+            exit(0);
+        } else if (p < 0) {
+            std::cerr << "fork: " << strerror(errno) << std::endl;
+            kill_workers(SIGTERM);
+            break;
+        }
+        worker_pids.push_back(p);
+    }
+
+    signal(SIGINT, kill_workers);
+    signal(SIGTERM, kill_workers);
+    for (pid_t p : worker_pids)
+        while (waitpid(p, 0, 0) < 0 && errno == EINTR)
+            /* do nothing */;
+}
 
+int main(int argc, char** argv) {
     bool is_server = false;
     String hostname = "localhost";
     int port = 18029;
+    int nworkers = 1;
+    load_options opt = { 0, 64, 0, false, false, false, 0, 0 };
     Clp_Parser* clp = Clp_NewParser(argc, argv, sizeof(options) / sizeof(options[0]), options);
 
     while (Clp_Next(clp) != Clp_Done) {
@@ -117,13 +802,77 @@ int main(int argc, char** argv) {
             hostname = clp->vstr;
         else if (Clp_IsLong(clp, "quiet"))
             quiet = !clp->negated;
+        else if (Clp_IsLong(clp, "threads"))
+            nworkers = std::max(clp->val.i, 1);
+        else if (Clp_IsLong(clp, "requests"))
+            opt.nrequests = clp->val.i;
+        else if (Clp_IsLong(clp, "window"))
+            opt.window = std::max(clp->val.i, 1);
+        else if (Clp_IsLong(clp, "payload"))
+            opt.payload = std::max(clp->val.i, 0);
+        else if (Clp_IsLong(clp, "unix"))
+            unix_path = clp->vstr;
+        else if (Clp_IsLong(clp, "memfd"))
+            opt.memfd = !clp->negated;
+        else if (Clp_IsLong(clp, "shm"))
+            opt.shm = !clp->negated;
+        else if (Clp_IsLong(clp, "timeout"))
+            opt.timeout = clp->val.d;
+        else if (Clp_IsLong(clp, "coalesce"))
+            coalesce = !clp->negated;
+        else if (Clp_IsLong(clp, "compress"))
+            compress = !clp->negated;
+        else if (Clp_IsLong(clp, "flush-delay")) {
+            coalesce = true;
+            flush_delay = clp->val.d / 1e6;
+        } else if (Clp_IsLong(clp, "inflight"))
+            max_inflight = std::max(clp->val.i, 1);
+        else if (Clp_IsLong(clp, "slow"))
+            slow_delay = clp->val.d / 1000;
+        else if (Clp_IsLong(clp, "slow-every"))
+            slow_every = std::max(clp->val.i, 1);
+        else if (Clp_IsLong(clp, "max-message"))
+            max_message = std::max(clp->val.i, 0);
+        else if (Clp_IsLong(clp, "chunk"))
+            chunk_threshold = std::max(clp->val.i, 0);
+        else if (Clp_IsLong(clp, "pool"))
+            opt.pool = std::max(clp->val.i, 0);
+        else if (Clp_IsLong(clp, "compare"))
+            opt.compare = true;
     }
 
-    if (is_server)
-        server(port);
-    else
-        client(hostname.c_str(), port);
+    // the Unix-domain listener is shared by all workers
+    int ufd = -1;
+    if (is_server && !unix_path.empty()) {
+        ufd = unix_listen(unix_path.c_str());
+        if (ufd < 0) {
+            std::cerr << "listen " << unix_path << ": " << strerror(-ufd) << std::endl;
+            exit(1);
+        }
+    }
+    if (!is_server && (opt.memfd || opt.shm || opt.compare)
+        && unix_path.empty()) {
+        std::cerr << "--memfd, --shm, and --compare require --unix PATH" << std::endl;
+        exit(1);
+    }
+    if (opt.memfd && opt.shm) {
+        std::cerr << "--memfd cannot pass descriptors over --shm" << std::endl;
+        exit(1);
+    }
+    if (opt.compare && opt.nrequests <= 0)
+        opt.nrequests = 100000;
 
-    tamer::loop();
-    tamer::cleanup();
+    if (is_server && nworkers > 1)
+        serve_workers(nworkers, port, ufd);
+    else if (is_server)
+        serve(port, false, ufd);
+    else {
+        tamer::initialize();
+        if (opt.compare)
+            compare(hostname.c_str(), port, opt);
+        else
+            client(hostname.c_str(), port, opt);
+        tamer::loop();
+        tamer::cleanup();
+    }
 }
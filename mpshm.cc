@@ -0,0 +1,275 @@
+#include "mpshm.hh"
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if HAVE_MEMFD_CREATE
+#include <sys/eventfd.h>
+#endif
+#include <algorithm>
+
+// Producer and consumer indexes live on separate cache lines. Indexes
+// count bytes and never wrap; a ring's capacity is a power of two.
+struct shm_channel::ring {
+    uint64_t head;              // advanced by the consumer
+    char pad0[56];
+    uint64_t tail;              // advanced by the producer
+    char pad1[56];
+    uint32_t reader_waiting;
+    uint32_t writer_waiting;
+    char pad2[56];
+};
+
+struct shm_channel::region {
+    uint64_t magic;
+    uint64_t capacity;
+    uint32_t closed[2];
+    char pad[48];
+    ring rings[2];
+};
+
+namespace {
+const uint64_t shm_magic = 0x6d70666473686d31ULL;
+#if HAVE_MEMFD_CREATE
+const int shm_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+bool is_eventfd(int fd) {
+    char path[64], target[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(path, target, sizeof(target));
+    return n == 20 && memcmp(target, "anon_inode:[eventfd]", 20) == 0;
+}
+#endif
+}
+
+shm_channel::shm_channel(region* r, size_t mapsize, int side, const int* fds)
+    : r_(r), capacity_(r->capacity), mapsize_(mapsize), side_(side),
+      nwakeups_(0) {
+    data_[0] = reinterpret_cast<char*>(r + 1);
+    data_[1] = data_[0] + capacity_;
+    memcpy(fds_, fds, sizeof(fds_));
+}
+
+/** @brief Create a channel whose rings each hold @a capacity bytes.
+
+    @a capacity is rounded up to a power of two. Returns null and sets
+    errno on failure, ENOSYS if the system lacks memfd_create. */
+shm_channel* shm_channel::create(size_t capacity) {
+#if !HAVE_MEMFD_CREATE
+    (void) capacity;
+    errno = ENOSYS;
+    return 0;
+#else
+    size_t cap = 4096;
+    while (cap < capacity)
+        cap *= 2;
+    size_t mapsize = sizeof(region) + 2 * cap;
+
+    int fds[nfds];
+    int n = 0, err = 0;
+    // sealing the size keeps the peer from truncating the mapping
+    // under us, which would fault our next access
+    fds[n] = memfd_create("msgpack-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fds[n] >= 0 && ftruncate(fds[n], mapsize) == 0
+        && fcntl(fds[n], F_ADD_SEALS, shm_seals) == 0)
+        for (++n; n != nfds; ++n)
+            if ((fds[n] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+                break;
+    void* m = MAP_FAILED;
+    if (n == nfds)
+        m = mmap(0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (m == MAP_FAILED) {
+        err = errno;
+        for (int i = 0; i != n; ++i)
+            close(fds[i]);
+        errno = err;
+        return 0;
+    }
+
+    region* r = static_cast<region*>(m);  // memfd pages start zeroed
+    r->capacity = cap;
+    __atomic_store_n(&r->magic, shm_magic, __ATOMIC_RELEASE);
+    return new shm_channel(r, mapsize, 0, fds);
+#endif
+}
+
+/** @brief Attach to a channel made by create() in another process.
+
+    @a fds holds nfds descriptors in the order of the creator's fds().
+    The memfd must be sealed against resizing, and the others must be
+    eventfds, which are made nonblocking. On success, the channel owns
+    them; on failure, returns null with errno set (EINVAL if the
+    descriptors are not as create() makes them), and the caller still
+    owns them. */
+shm_channel* shm_channel::attach(const int* fds) {
+#if !HAVE_MEMFD_CREATE
+    (void) fds;
+    errno = ENOSYS;
+    return 0;
+#else
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals < 0 || (seals & shm_seals) != shm_seals) {
+        errno = EINVAL;
+        return 0;
+    }
+    for (int i = 1; i != nfds; ++i) {
+        int flags;
+        if (!is_eventfd(fds[i])) {
+            errno = EINVAL;
+            return 0;
+        } else if ((flags = fcntl(fds[i], F_GETFL)) < 0
+                   || fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) < 0)
+            return 0;
+    }
+
+    struct stat st;
+    if (fstat(fds[0], &st) < 0)
+        return 0;
+    if (size_t(st.st_size) < sizeof(region)) {
+        errno = EINVAL;
+        return 0;
+    }
+    void* m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fds[0], 0);
+    if (m == MAP_FAILED)
+        return 0;
+    region* r = static_cast<region*>(m);
+    uint64_t cap = r->capacity;
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != shm_magic
+        || (cap & (cap - 1)) != 0
+        || sizeof(region) + 2 * cap != size_t(st.st_size)) {
+        munmap(m, st.st_size);
+        errno = EINVAL;
+        return 0;
+    }
+    return new shm_channel(r, st.st_size, 1, fds);
+#endif
+}
+
+shm_channel::~shm_channel() {
+    shutdown();
+    munmap(r_, mapsize_);
+    for (int i = 0; i != nfds; ++i)
+        close(fds_[i]);
+}
+
+void shm_channel::signal(int fd) {
+    uint64_t one = 1;
+    ssize_t r = ::write(fd, &one, sizeof(one));
+    (void) r;
+    ++nwakeups_;
+}
+
+void shm_channel::drain(int fd) {
+    uint64_t x;
+    ssize_t r = ::read(fd, &x, sizeof(x));
+    (void) r;
+}
+
+/** @brief Read up to @a len bytes from the peer.
+
+    Returns the number of bytes read; 0 once the peer has closed and
+    its data is consumed; or -1 with errno EAGAIN if no data is ready, in
+    which case read_wait_fd() will become readable when it is, or EPROTO
+    if the ring's indexes are corrupt. */
+ssize_t shm_channel::read(char* buf, size_t len) {
+    ring& rg = r_->rings[1 - side_];
+    uint64_t head = rg.head;
+    uint64_t tail = __atomic_load_n(&rg.tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        // Arm the wakeup, then look again: the producer checks the flag
+        // after publishing its tail, so one of us sees the other.
+        drain(read_wait_fd());
+        __atomic_store_n(&rg.reader_waiting, 1, __ATOMIC_SEQ_CST);
+        bool closed = __atomic_load_n(&r_->closed[1 - side_], __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&rg.tail, __ATOMIC_SEQ_CST);
+        if (head == tail) {
+            if (closed)
+                return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+        __atomic_store_n(&rg.reader_waiting, 0, __ATOMIC_RELAXED);
+    }
+    // the indexes live in memory the peer can write
+    if (tail - head > capacity_) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t n = std::min(len, size_t(tail - head));
+    size_t off = head & (capacity_ - 1);
+    size_t first = std::min(n, capacity_ - off);
+    const char* data = data_[1 - side_];
+    memcpy(buf, data + off, first);
+    memcpy(buf + first, data, n - first);
+    __atomic_store_n(&rg.head, head + n, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rg.writer_waiting, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&rg.writer_waiting, 0, __ATOMIC_ACQ_REL))
+        signal(space_fd(1 - side_));
+    return n;
+}
+
+/** @brief Write as much of @a iov as fits to the peer.
+
+    Returns the number of bytes written, or -1 with errno EAGAIN if the
+    ring is full (write_wait_fd() will become readable when it drains),
+    EPIPE if the peer has closed, or EPROTO if the ring's indexes are
+    corrupt. */
+ssize_t shm_channel::writev(const struct iovec* iov, int iov_count) {
+    ring& rg = r_->rings[side_];
+    if (__atomic_load_n(&r_->closed[1 - side_], __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+    uint64_t tail = rg.tail;
+    uint64_t head = __atomic_load_n(&rg.head, __ATOMIC_ACQUIRE);
+    if (tail - head > capacity_) {
+        errno = EPROTO;
+        return -1;
+    } else if (tail - head == capacity_) {
+        drain(write_wait_fd());
+        __atomic_store_n(&rg.writer_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&rg.head, __ATOMIC_SEQ_CST);
+        if (tail - head > capacity_) {
+            errno = EPROTO;
+            return -1;
+        } else if (tail - head == capacity_) {
+            errno = EAGAIN;
+            return -1;
+        }
+        __atomic_store_n(&rg.writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    size_t space = capacity_ - (tail - head);
+    size_t n = 0;
+    char* data = data_[side_];
+    for (int i = 0; i != iov_count && n != space; ++i) {
+        size_t len = std::min(iov[i].iov_len, space - n);
+        size_t off = (tail + n) & (capacity_ - 1);
+        size_t first = std::min(len, capacity_ - off);
+        memcpy(data + off, iov[i].iov_base, first);
+        memcpy(data, static_cast<const char*>(iov[i].iov_base) + first,
+               len - first);
+        n += len;
+    }
+    __atomic_store_n(&rg.tail, tail + n, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rg.reader_waiting, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&rg.reader_waiting, 0, __ATOMIC_ACQ_REL))
+        signal(data_fd(side_));
+    return n;
+}
+
+void shm_channel::shutdown() {
+    if (!__atomic_exchange_n(&r_->closed[side_], 1, __ATOMIC_SEQ_CST)) {
+        signal(data_fd(side_));
+        signal(space_fd(1 - side_));
+    }
+}
@@ -0,0 +1,96 @@
+// -*- mode: c++ -*-
+#ifndef PEQUOD_MPSHM_HH
+#define PEQUOD_MPSHM_HH
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+/** @class shm_channel
+    @brief Bidirectional byte stream over two shared-memory rings.
+
+    Each direction is a single-producer, single-consumer ring in a memfd
+    mapping shared by the two endpoints, so data moves by memcpy alone.
+    An eventfd per ring and direction wakes a reader that found its ring
+    empty, or a writer that found it full; endpoints that keep up with
+    each other make no system calls.
+
+    One endpoint calls create() and sends the descriptors in fds() to its
+    peer, for instance with msgpack_fd::attach_fd(); the peer calls
+    attach(). read() and writev() then behave like their system-call
+    namesakes on a nonblocking socket. Deleting either endpoint closes
+    the channel: the peer reads any data already written and then end of
+    file, and its writes fail with EPIPE. */
+class shm_channel {
+  public:
+    enum { nfds = 5 };
+
+    static shm_channel* create(size_t capacity);
+    static shm_channel* attach(const int* fds);
+    ~shm_channel();
+
+    inline const int* fds() const;
+    inline int read_wait_fd() const;
+    inline int write_wait_fd() const;
+    inline size_t capacity() const;
+    inline size_t wakeups() const;
+
+    ssize_t read(char* buf, size_t len);
+    ssize_t writev(const struct iovec* iov, int iov_count);
+
+  private:
+    struct ring;
+    struct region;
+    region* r_;
+    char* data_[2];
+    size_t capacity_;
+    size_t mapsize_;
+    int side_;
+    int fds_[nfds];
+    size_t nwakeups_;
+
+    shm_channel(region* r, size_t mapsize, int side, const int* fds);
+    shm_channel(const shm_channel&) = delete;
+    shm_channel& operator=(const shm_channel&) = delete;
+
+    // fds_[0] is the memfd; fds_[1 + 2*i] signals data in ring i, and
+    // fds_[2 + 2*i] signals space in ring i. Side i writes ring i.
+    inline int data_fd(int ring) const;
+    inline int space_fd(int ring) const;
+    void signal(int fd);
+    static void drain(int fd);
+    void shutdown();
+};
+
+inline const int* shm_channel::fds() const {
+    return fds_;
+}
+
+inline int shm_channel::data_fd(int ring) const {
+    return fds_[1 + 2 * ring];
+}
+
+inline int shm_channel::space_fd(int ring) const {
+    return fds_[2 + 2 * ring];
+}
+
+/** @brief Return a descriptor that becomes readable when read() may
+    make progress after failing with EAGAIN. */
+inline int shm_channel::read_wait_fd() const {
+    return data_fd(1 - side_);
+}
+
+/** @brief Return a descriptor that becomes readable when writev() may
+    make progress after failing with EAGAIN. */
+inline int shm_channel::write_wait_fd() const {
+    return space_fd(side_);
+}
+
+inline size_t shm_channel::capacity() const {
+    return capacity_;
+}
+
+inline size_t shm_channel::wakeups() const {
+    return nwakeups_;
+}
+
+#endif
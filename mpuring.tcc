@@ -0,0 +1,260 @@
+// -*- mode: c++ -*-
+#include "mpuring.hh"
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <errno.h>
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#if HAVE_IO_URING
+
+struct uring_driver::ring {
+    int fd;
+    int efd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+namespace {
+enum { ring_sq_entries = 1024, ring_cq_entries = 16384 };
+const uint64_t cancel_user_data = ~uint64_t(0);
+}
+
+uring_driver::ring* uring_driver::make_ring() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = ring_cq_entries;
+    int fd = syscall(__NR_io_uring_setup, ring_sq_entries, &p);
+    if (fd < 0)
+        return 0;
+    // tamer fds are nonblocking: without fast poll, a read of an idle
+    // socket completes at once with -EAGAIN instead of waiting
+#ifdef IORING_FEAT_FAST_POLL
+    bool fast_poll = p.features & IORING_FEAT_FAST_POLL;
+#else
+    bool fast_poll = false;
+#endif
+    if (!fast_poll) {
+        close(fd);
+        return 0;
+    }
+
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sqsz = cqsz = std::max(sqsz, cqsz);
+    char* sq = (char*) mmap(0, sqsz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = sq;
+    if (sq != MAP_FAILED && !single)
+        cq = (char*) mmap(0, cqsz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED)
+        sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+    int efd = -1;
+    if (sqes != MAP_FAILED)
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0
+        || syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+                   &efd, 1) < 0) {
+        // leave any mappings for process exit; the driver is unusable
+        if (efd >= 0)
+            close(efd);
+        close(fd);
+        return 0;
+    }
+
+    uring_driver::ring* r = new uring_driver::ring;
+    r->fd = fd;
+    r->efd = efd;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->sqes = (struct io_uring_sqe*) sqes;
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return r;
+}
+
+uring_driver* uring_driver::get() {
+    static bool initialized = false;
+    static uring_driver* driver = 0;
+    if (!initialized) {
+        initialized = true;
+        if (ring* r = make_ring())
+            driver = new uring_driver(r);
+    }
+    return driver;
+}
+
+uring_driver::uring_driver(ring* r)
+    : r_(r), pending_(0), nsubmit_(0), nops_(0), ncomplete_(0) {
+    submitter();
+    reaper();
+}
+
+struct io_uring_sqe* uring_driver::next_sqe() {
+    unsigned tail = *r_->sq_tail;
+    if (tail - __atomic_load_n(r_->sq_head, __ATOMIC_ACQUIRE)
+        == r_->sq_entries)
+        submit();
+    struct io_uring_sqe* sqe = &r_->sqes[tail & r_->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r_->sq_array[tail & r_->sq_mask] = tail & r_->sq_mask;
+    return sqe;
+}
+
+/** @brief Queue a read of up to @a len bytes from @a fd into @a buf.
+
+    @a done receives the byte count, 0 at EOF, or a negative errno. The
+    caller must keep @a buf alive until @a done triggers. Returns an
+    operation ID for cancel(). */
+uint64_t uring_driver::read(int fd, char* buf, size_t len,
+                            tamer::event<ssize_t> done) {
+    uint32_t slot;
+    if (free_slots_.empty()) {
+        slot = slots_.size();
+        slots_.push_back(tamer::event<ssize_t>());
+        generation_.push_back(0);
+    } else {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    }
+    slots_[slot] = std::move(done);
+    uint64_t op = (uint64_t(++generation_[slot]) << 32) | slot;
+
+    struct io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = op;
+    __atomic_store_n(r_->sq_tail, *r_->sq_tail + 1, __ATOMIC_RELEASE);
+
+    ++pending_;
+    ++nops_;
+    submit_wake_();
+    return op;
+}
+
+void uring_driver::cancel(uint64_t op) {
+    uint32_t slot = op;
+    if (slot >= slots_.size() || generation_[slot] != uint32_t(op >> 32)
+        || !slots_[slot])
+        return;
+    struct io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = op;
+    sqe->user_data = cancel_user_data;
+    __atomic_store_n(r_->sq_tail, *r_->sq_tail + 1, __ATOMIC_RELEASE);
+    ++pending_;
+    submit_wake_();
+}
+
+void uring_driver::submit() {
+    while (pending_) {
+        int n = syscall(__NR_io_uring_enter, r_->fd, pending_, 0, 0, 0, 0);
+        ++nsubmit_;
+        if (n > 0)
+            pending_ -= n;
+        else if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+        else if (n <= 0) {
+            reap();             // completion queue full: make room
+            if (n == 0)
+                break;
+        }
+    }
+}
+
+void uring_driver::reap() {
+    unsigned head = *r_->cq_head;
+    unsigned tail = __atomic_load_n(r_->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe* cqe = &r_->cqes[head & r_->cq_mask];
+        uint64_t op = cqe->user_data;
+        ssize_t res = cqe->res;
+        if (op == cancel_user_data)
+            continue;
+        uint32_t slot = op;
+        if (slot < slots_.size() && generation_[slot] == uint32_t(op >> 32)) {
+            ++ncomplete_;
+            tamer::event<ssize_t> e = std::move(slots_[slot]);
+            free_slots_.push_back(slot);
+            e.trigger(res);
+        }
+    }
+    __atomic_store_n(r_->cq_head, head, __ATOMIC_RELEASE);
+}
+
+tamed void uring_driver::submitter() {
+    // Submit once per event-loop pass, after every runnable coroutine has
+    // had a chance to queue its operations.
+    while (1) {
+        if (!pending_)
+            twait { submit_wake_ = make_event(); }
+        twait { tamer::at_asap(make_event()); }
+        submit();
+    }
+}
+
+tamed void uring_driver::reaper() {
+    tvars { uint64_t x; }
+    while (1) {
+        twait { tamer::at_fd_read(r_->efd, make_event()); }
+        while (::read(r_->efd, &x, sizeof(x)) > 0)
+            /* do nothing */;
+        reap();
+    }
+}
+
+Json uring_driver::status() const {
+    return Json().set("ring_enter_calls", nsubmit_)
+        .set("ring_operations", nops_)
+        .set("ring_completions", ncomplete_)
+        .set("ring_inflight", slots_.size() - free_slots_.size());
+}
+
+#else
+
+uring_driver* uring_driver::get() {
+    return 0;
+}
+
+uint64_t uring_driver::read(int, char*, size_t, tamer::event<ssize_t> done) {
+    done(-ENOSYS);
+    return 0;
+}
+
+void uring_driver::cancel(uint64_t) {
+}
+
+Json uring_driver::status() const {
+    return Json();
+}
+
+#endif
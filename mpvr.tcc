@@ -3,8 +3,15 @@
 #include "mpfd.hh"
 #include "mpvr.hh"
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <time.h>
 #include <algorithm>
 #include <set>
 #include <fstream>
@@ -19,6 +26,10 @@ static const String m_vri_commit("commit");
     //        [logno, [view_delta, client_uid, client_seqno, request]*]]
 static const String m_vri_ack("ack");
     // R->P: [3, xxx, viewno, storeno]
+static const String m_vri_snapshot("snap");
+    // P->R: [3, xxx, viewno, snapshotno, index, nchunks, chunk]
+static const String m_vri_snapshot_ack("snapack");
+    // R->P: [3, xxx, viewno, snapshotno, nchunks_received]
 static const String m_vri_handshake("handshake");
     // handshake_value
 static const String m_vri_join("join");
@@ -241,12 +252,13 @@ void Vrview::clear_preparation(bool is_next) {
             it.has_ackno_ = it.has_matching_logno_ = false;
 }
 
-void Vrview::add(String peer_uid, const String& my_uid) {
+void Vrview::add(String peer_uid, Json peer_name, const String& my_uid) {
     auto it = members.begin();
     while (it != members.end() && it->uid < peer_uid)
         ++it;
     if (it == members.end() || it->uid != peer_uid)
-        members.insert(it, member_type(std::move(peer_uid), Json()));
+        members.insert(it, member_type(std::move(peer_uid),
+                                       std::move(peer_name)));
 
     my_index = -1;
     for (size_t i = 0; i != members.size(); ++i)
@@ -320,7 +332,12 @@ bool Vrview::account_all_acks() {
 Vrreplica::Vrreplica(const String& group_name, Vrchannel* me, std::mt19937& rg)
     : group_name_(group_name), want_member_(!!me), me_(me),
       decideno_(0), commitno_(0), ackno_(0), sackno_(0),
-      stopped_(false), commit_sent_at_(0),
+      storeno_(0), sstoreno_(0), next_view_behind_(false), stopped_(false),
+      wal_(nullptr),
+      state_(nullptr), snapshot_interval_(0), appliedno_(0), snapshotno_(0),
+      snaprecvno_(0), snaprecvn_(0),
+      batch_interval_(0), batch_max_(256), batch_pending_(false),
+      batch_opened_at_(0), commit_sent_at_(0),
       rg_(rg) {
     if (me_) {
         cur_view_ = Vrview::make_singular(me_->local_uid(),
@@ -364,6 +381,21 @@ String Vrreplica::unparse_view_state() const {
     return sa.take_string();
 }
 
+// Return how to reach @a peer_uid: the name given to join(), else the
+// name the peer advertised in a view.
+Json Vrreplica::node_name(const String& peer_uid) const {
+    auto it = node_names_.find(peer_uid);
+    if (it != node_names_.end() && it->second)
+        return it->second;
+    for (auto& m : next_view_.members)
+        if (m.uid == peer_uid)
+            return m.peer_name;
+    for (auto& m : cur_view_.members)
+        if (m.uid == peer_uid)
+            return m.peer_name;
+    return Json::object("uid", peer_uid);
+}
+
 tamed void Vrreplica::listen_loop() {
     tamed { Vrchannel* peer; }
     while (1) {
@@ -402,8 +434,7 @@ tamed void Vrreplica::connect(String peer_uid, event<> done) {
     }
 
     log_connection(uid(), peer_uid) << "connecting\n";
-    if (!(peer_name = node_names_[peer_uid]))
-        peer_name = Json::object("uid", peer_uid);
+    peer_name = node_name(peer_uid);
     twait { me_->connect(peer_uid, peer_name, make_event(peer)); }
     if (peer) {
         assert(peer->remote_uid() == peer_uid);
@@ -485,6 +516,10 @@ tamed void Vrreplica::connection_loop(Vrchannel* peer) {
             process_commit(peer, msg);
         else if (msg[0] == m_vri_ack)
             process_ack(peer, msg);
+        else if (msg[0] == m_vri_snapshot)
+            process_snapshot(peer, msg);
+        else if (msg[0] == m_vri_snapshot_ack)
+            process_snapshot_ack(peer, msg);
         else if (msg[0] == m_vri_join)
             process_join(peer, msg);
         else if (msg[0] == m_vri_view)
@@ -569,7 +604,8 @@ void Vrreplica::process_view(Vrchannel* who, const Json& msg) {
     }
     if (next_view_.nconfirmed > next_view_.f()
         && next_view_.me_primary()
-        && want_send != 2) {
+        && want_send != 2
+        && !next_view_behind_) {
         if (cur_view_.viewno != next_view_.viewno)
             primary_adopt_view_change(who);
         else
@@ -585,6 +621,18 @@ void Vrreplica::process_view_transfer_log(Vrchannel* who, Json& payload) {
            && payload["log"].size() % 4 == 0
            && next_view_.me_primary());
     lognumber_t logno = payload["logno"].to_u();
+    // A member that snapshots truncates its log whether or not everyone
+    // has the entries. If it sends from past our ackno_, it has discarded
+    // entries we cannot check our log against. Leave this view to time
+    // out; a member further along will lead the next one.
+    if (state_ && logno > ackno_) {
+        if (!next_view_behind_)
+            logger() << tamer::recent() << ":" << uid() << ": behind "
+                     << who->remote_uid() << "'s snapshot, not leading "
+                     << unparse_view_state() << "\n";
+        next_view_behind_ = true;
+        return;
+    }
     assert(logno <= last_logno());
     const Json& log = payload["log"];
     lognumber_t matching_logno = logno + log.size();
@@ -617,6 +665,10 @@ void Vrreplica::process_view_transfer_log(Vrchannel* who, Json& payload) {
         }
         if (!lix->is_real() || lix->viewno < li.viewno) {
             *lix = std::move(li);
+            // a replaced entry in log_ is not revisited when the view is
+            // adopted, so log it now
+            if (logno < log_.last())
+                persist(logno);
             next_view_.reduce_matching_logno(logno);
         } else if (lix->viewno == li.viewno)
             assert(lix->client_uid == li.client_uid
@@ -643,6 +695,10 @@ void Vrreplica::process_view_check_log(Vrchannel* who, Json& payload) {
 }
 
 void Vrreplica::primary_adopt_view_change(Vrchannel* who) {
+    // batches from an earlier view will not commit as sent
+    batch_pending_ = false;
+    batch_sent_.clear();
+
     next_view_.account_all_acks();
     cur_view_ = next_view_;
     process_at_number(cur_view_.viewno, at_view_);
@@ -650,11 +706,13 @@ void Vrreplica::primary_adopt_view_change(Vrchannel* who) {
 
     // transfer next_log_ into log_
     for (lognumber_t i = next_log_.first(); i != next_log_.last(); ++i)
-        if (i == log_.last())
+        if (i == log_.last()) {
             log_.push_back(std::move(next_log_[i]));
-        else if (!log_[i].is_real() || log_[i].viewno < next_log_[i].viewno)
+            persist(i);
+        } else if (!log_[i].is_real() || log_[i].viewno < next_log_[i].viewno) {
             log_[i] = std::move(next_log_[i]);
-        else if (log_[i].viewno > next_log_[i].viewno)
+            persist(i);
+        } else if (log_[i].viewno > next_log_[i].viewno)
             next_view_.reduce_matching_logno(i);
     next_log_.clear();
 
@@ -662,8 +720,12 @@ void Vrreplica::primary_adopt_view_change(Vrchannel* who) {
     for (lognumber_t i = commitno_; i != last_logno(); ++i)
         if (!log_[i].is_real()) {
             log_.resize(i - log_.first());
+            if (wal_)
+                wal_->truncate(i);
             break;
         }
+    if (wal_)
+        primary_ack_after_sync(cur_view_.viewno, last_logno());
 
     // send log to replicas
     for (auto it = cur_view_.members.begin();
@@ -718,6 +780,14 @@ tamed void Vrreplica::send_peer(String peer_uid, Json msg) {
         ep->send(msg);
 }
 
+tamed void Vrreplica::send_peer_encoded(String peer_uid, String msg) {
+    tamed { Vrchannel* ep = nullptr; }
+    while (!(ep = endpoints_[peer_uid]))
+        twait { connect(peer_uid, make_event()); }
+    if (ep != me_)
+        ep->send_encoded(msg);
+}
+
 void Vrreplica::send_view(Vrchannel* who, Json payload, Json seqno) {
     if (!payload.get("members"))
         payload.merge(view_payload(who->remote_uid()));
@@ -744,7 +814,7 @@ void Vrreplica::broadcast_view() {
 void Vrreplica::process_join(Vrchannel* who, const Json&) {
     Vrview v;
     if (!next_view_.count(who->remote_uid())) {
-        next_view_.add(who->remote_uid(), uid());
+        next_view_.add(who->remote_uid(), who->remote_name(), uid());
         start_view_change();
     }
 }
@@ -752,6 +822,7 @@ void Vrreplica::process_join(Vrchannel* who, const Json&) {
 void Vrreplica::initialize_next_view() {
     cur_view_.clear_preparation(false);
     next_view_sent_confirm_ = false;
+    next_view_behind_ = false;
     next_log_.clear();
     Json my_msg = Json::object("ackno", ackno_.value());
     cur_view_.prepare(uid(), my_msg, false);
@@ -783,55 +854,153 @@ void Vrreplica::process_request(Vrchannel* who, const Json& msg) {
         return;
     }
 
-    // add request to our log
-    lognumber_t from_storeno = last_logno();
+    // add requests to our log, opening a batch if none is pending; a
+    // message with more requests than a batch holds spans several
     unsigned seqno = msg[2].to_u64();
-    for (int i = 3; i != msg.size(); ++i, ++seqno)
-        log_.emplace_back(cur_view_.viewno, who->remote_uid(),
-                          seqno, msg[i]);
-    process_at_number(from_storeno, at_store_);
+    int i = 3;
+    while (i != msg.size()) {
+        lognumber_t from_storeno = last_logno();
+        if (!batch_pending_ || batch_view_ != cur_view_.viewno) {
+            batch_pending_ = true;
+            batch_view_ = cur_view_.viewno;
+            batch_first_ = from_storeno;
+            batch_opened_at_ = tamer::drecent();
+            batch_timer(batch_view_, batch_first_);
+        }
+        for (; i != msg.size()
+                 && last_logno() - batch_first_ < lognumberdiff_t(batch_max_);
+             ++i, ++seqno) {
+            log_.emplace_back(cur_view_.viewno, who->remote_uid(),
+                              seqno, msg[i]);
+            persist(last_logno() - 1);
+        }
+        process_at_number(from_storeno, at_store_);
+
+        // the new commits are replicated only here, or with a WAL, once
+        // they are durable here
+        if (wal_)
+            primary_ack_after_sync(cur_view_.viewno, last_logno());
+        else
+            cur_view_.account_ack(&cur_view_.primary(), last_logno());
+
+        if (last_logno() - batch_first_ >= lognumberdiff_t(batch_max_))
+            send_batch();
+    }
+}
+
+/** @brief Set how the primary batches client requests.
+
+    The primary sends backups one commit message per batch: the requests
+    from all clients that arrive within @a interval seconds of the
+    batch's first, up to @a max_entries entries. An @a interval of 0,
+    the default, batches the requests that arrive during one event-loop
+    turn. */
+void Vrreplica::set_batching(double interval, unsigned max_entries) {
+    assert(interval >= 0 && max_entries > 0);
+    batch_interval_ = interval;
+    batch_max_ = max_entries;
+}
+
+tamed void Vrreplica::batch_timer(viewnumber_t view, lognumber_t first) {
+    if (batch_interval_ > 0)
+        twait { tamer::at_delay(batch_interval_, make_event()); }
+    else
+        twait { tamer::at_asap(make_event()); }
+    if (batch_pending_ && batch_view_ == view && batch_first_ == first)
+        send_batch();
+}
+
+Json Vrreplica::status() const {
+    Json j = Json().set("uid", uid())
+        .set("viewno", cur_view_.viewno.value())
+        .set("primary", is_primary())
+        .set("commitno", commitno_.value())
+        .set("batches", batch_sizes_.count());
+    if (batch_sizes_.count())
+        j.set("batch_mean", batch_sizes_.mean())
+            .set("batch_p50", batch_sizes_.percentile(0.5))
+            .set("batch_max", batch_sizes_.max());
+    if (commit_latency_.count())
+        j.set("commit_p50_us", commit_latency_.percentile(0.5) / 1000.0)
+            .set("commit_p99_us", commit_latency_.percentile(0.99) / 1000.0);
+    if (wal_)
+        j.set("wal", wal_->status());
+    return j;
+}
+
+void Vrreplica::send_batch() {
+    batch_pending_ = false;
+    if (!is_primary() || between_views() || batch_view_ != cur_view_.viewno)
+        return;
+    lognumber_t from_storeno = std::max(batch_first_, log_.first());
+    if (from_storeno >= last_logno())
+        return;
+    batch_sizes_.record(last_logno() - from_storeno);
+    batch_sent_.push_back(std::make_pair(last_logno(), batch_opened_at_));
 
     // broadcast commit to backups
-    Json commit_msg = commit_log_message(from_storeno, last_logno());
+    String commit_msg = commit_log_message(from_storeno, last_logno());
     for (auto it = cur_view_.members.begin();
          it != cur_view_.members.end(); ++it)
         if (!it->has_ackno()
             || it->ackno() == from_storeno
             || tamer::drecent() <=
                  it->ackno_changed_at() + k_.retransmit_log_timeout)
-            send_peer(it->uid, commit_msg);
+            send_peer_encoded(it->uid, commit_msg);
         else
             send_commit_log(&*it, it->ackno(), last_logno());
     commit_sent_at_ = tamer::drecent();
+}
 
-    // the new commits are replicated only here
-    cur_view_.account_ack(&cur_view_.primary(), last_logno());
+// Return log entry @a logno's elements of a commit message, encoding
+// them only if this view has not already.
+const String& Vrreplica::encoded_entry(lognumber_t logno) const {
+    const Vrlogitem& li = log_[logno];
+    if (!li.encoded || li.encoded_view != cur_view_.viewno) {
+        StringAccum sa;
+        msgpack::unparser<StringAccum>(sa)
+            << (cur_view_.viewno - li.viewno) << li.client_uid
+            << li.client_seqno << li.request;
+        li.encoded = sa.take_string();
+        li.encoded_view = cur_view_.viewno;
+    }
+    return li.encoded;
 }
 
-Json Vrreplica::commit_log_message(lognumber_t first, lognumber_t last) const {
-    Json msg = Json::array(m_vri_commit,
-                           Json::null,
-                           cur_view_.viewno.value(),
-                           commitno_.value(),
-                           commitno_ - decideno_);
+String Vrreplica::commit_log_message(lognumber_t first,
+                                     lognumber_t last) const {
     first = std::max(first, log_.first());
+    uint32_t size = 5;
+    size_t length = 64;
+    if (first < last)
+        size += 1 + 4 * (last - first);
+    for (lognumber_t i = first; i < last; ++i)
+        length += encoded_entry(i).length();
+    StringAccum sa(length);
+    msgpack::unparser<StringAccum> mu(sa);
+    mu << msgpack::array(size) << m_vri_commit << Json::null
+       << cur_view_.viewno.value() << commitno_.value()
+       << (commitno_ - decideno_);
     if (first < last) {
-        msg.reserve(msg.size() + 1 + (last - first) * 4);
-        msg.push_back(first.value());
-        for (lognumber_t i = first; i != last; ++i) {
-            const Vrlogitem& li = log_[i];
-            msg.push_back_list(cur_view_.viewno - li.viewno,
-                               li.client_uid, li.client_seqno, li.request);
-        }
+        mu << first.value();
+        for (lognumber_t i = first; i != last; ++i)
+            mu.write_raw(encoded_entry(i));
     }
-    return msg;
+    return sa.take_string();
 }
 
 void Vrreplica::send_commit_log(Vrview::member_type* peer,
                                 lognumber_t first, lognumber_t last) {
     if (peer->has_ackno() && peer->ackno() < first)
         first = peer->ackno();
-    send_peer(peer->uid, commit_log_message(first, last));
+    // a peer that needs entries we have discarded gets the snapshot, and
+    // then the log from the snapshot on; meanwhile, commit messages
+    // carry no entries
+    if (state_ && first < log_.first() && peer->uid != uid()) {
+        send_snapshot(peer->uid);
+        first = last = last_logno();
+    }
+    send_peer_encoded(peer->uid, commit_log_message(first, last));
 }
 
 void Vrreplica::process_commit(Vrchannel* who, const Json& msg) {
@@ -852,6 +1021,8 @@ void Vrreplica::process_commit(Vrchannel* who, const Json& msg) {
         cur_view_ = next_view_;
         next_view_sent_confirm_ = true;
         // acknowledge `commitno_` until log confirmed
+        storeno_ = std::min(storeno_, commitno_);
+        sstoreno_ = std::max(commitno_, sstoreno_);
         ackno_ = std::min(ackno_, commitno_);
         sackno_ = std::max(commitno_, sackno_);
         process_at_number(cur_view_.viewno, at_view_);
@@ -870,6 +1041,8 @@ void Vrreplica::process_commit(Vrchannel* who, const Json& msg) {
     // NB might have decideno < first_logno() near view changes!
     assert(decideno <= last_logno());
     commitno_ = std::max(commitno_, decideno);
+    storeno_ = std::max(storeno_, decideno);
+    sstoreno_ = std::max(sstoreno_, decideno);
     ackno_ = std::max(ackno_, decideno);
     sackno_ = std::max(sackno_, decideno);
 
@@ -877,7 +1050,7 @@ void Vrreplica::process_commit(Vrchannel* who, const Json& msg) {
         process_commit_log(msg);
 
     if (commitno > commitno_
-        && commitno >= ackno_
+        && commitno >= storeno_
         && commitno <= last_logno()) {
         commitno_ = commitno;
         process_at_number(commitno_, at_commit_);
@@ -886,17 +1059,25 @@ void Vrreplica::process_commit(Vrchannel* who, const Json& msg) {
     if (decideno > decideno_
         && decideno <= commitno_) {
         decideno_ = decideno;
-        while (log_.first() < decideno_)
-            log_.pop_front();
+        discard_decided();
     }
+    apply_committed();
 
-    if (msg.size() > 6 || ackno_ != old_ackno) {
-        Json ack_msg = Json::array(m_vri_ack,
-                                   Json::null,
-                                   cur_view_.viewno.value(),
-                                   ackno_.value(),
-                                   sackno_ - ackno_);
-        who->send(std::move(ack_msg));
+    // with a WAL, acknowledge stored entries only once they are durable
+    if (wal_) {
+        if (msg.size() > 6 || storeno_ != ackno_ || sstoreno_ != sackno_)
+            ack_after_sync(who->remote_uid(), cur_view_.viewno);
+    } else {
+        ackno_ = storeno_;
+        sackno_ = sstoreno_;
+        if (msg.size() > 6 || ackno_ != old_ackno) {
+            Json ack_msg = Json::array(m_vri_ack,
+                                       Json::null,
+                                       cur_view_.viewno.value(),
+                                       ackno_.value(),
+                                       sackno_ - ackno_);
+            who->send(std::move(ack_msg));
+        }
     }
 
     primary_received_at_ = tamer::drecent();
@@ -906,12 +1087,12 @@ void Vrreplica::process_commit_log(const Json& msg) {
     lognumber_t logno = msg[5].to_u();
     size_t nlog = (msg.size() - 6) / 4;
 
-    if (ackno_ == sackno_ && logno > sackno_)
-        sackno_ = logno;
-    if (logno <= ackno_)
-        ackno_ = std::max(ackno_, logno + nlog);
-    if (logno <= sackno_)
-        sackno_ = std::max(ackno_, std::min(sackno_, logno));
+    if (storeno_ == sstoreno_ && logno > sstoreno_)
+        sstoreno_ = logno;
+    if (logno <= storeno_)
+        storeno_ = std::max(storeno_, logno + nlog);
+    if (logno <= sstoreno_)
+        sstoreno_ = std::max(storeno_, std::min(sstoreno_, logno));
 
     while (logno > last_logno())
         log_.push_back(Vrlogitem(cur_view_.viewno - 1, String(), 0, Json()));
@@ -920,11 +1101,14 @@ void Vrreplica::process_commit_log(const Json& msg) {
         if (logno >= log_.first()) {
             Vrlogitem li(cur_view_.viewno - msg[i].to_u(),
                          msg[i + 1].to_s(), msg[i + 2].to_u(), msg[i + 3]);
-            if (logno == log_.last())
+            if (logno == log_.last()) {
                 log_.push_back(std::move(li));
-            else if (!log_[logno].is_real()
-                     || log_[logno].viewno < li.viewno)
+                persist(logno);
+            } else if (!log_[logno].is_real()
+                       || log_[logno].viewno < li.viewno) {
                 log_[logno] = std::move(li);
+                persist(logno);
+            }
         }
 
     process_at_number(last_logno(), at_store_);
@@ -956,11 +1140,12 @@ void Vrreplica::process_ack(Vrchannel* who, const Json& msg) {
     if (peer->ackno_count() == cur_view_.size()
         && ackno > decideno_)
         decideno_ = ackno;
-    while (log_.first() < decideno_)
-        log_.pop_front();
+    discard_decided();
 
     // primary doesn't really have an ackno, but update for check()'s sake
-    ackno_ = sackno_ = last_logno();
+    storeno_ = sstoreno_ = last_logno();
+    if (!wal_)
+        ackno_ = sackno_ = last_logno();
 
     // if sack, respond with gap
     if (msg.size() > 4 && msg[4].to_u())
@@ -978,6 +1163,14 @@ void Vrreplica::process_ack_update_commitno(lognumber_t commitno) {
     }
     commitno_ = commitno;
     process_at_number(commitno_, at_commit_);
+    apply_committed();
+    // a batch's commit latency runs from its first request's arrival
+    // until the primary commits all of it
+    while (!batch_sent_.empty() && batch_sent_.front().first <= commitno_) {
+        double latency = tamer::drecent() - batch_sent_.front().second;
+        commit_latency_.record(uint64_t(latency * 1e9));
+        batch_sent_.pop_front();
+    }
     for (auto it = messages.begin(); it != messages.end(); ++it) {
         Vrchannel* ep = endpoints_[it->first];
         if (ep) {
@@ -987,6 +1180,340 @@ void Vrreplica::process_ack_update_commitno(lognumber_t commitno) {
     }
 }
 
+void Vrreplica::discard_decided() {
+    // with a state machine, keep only what the snapshot does not cover;
+    // members that lag behind it catch up from the snapshot
+    lognumber_t keep = state_ ? snapshotno_ : decideno_;
+    while (log_.first() < keep)
+        log_.pop_front();
+    // the WAL must still hold what the durable state lacks
+    if (wal_) {
+        lognumber_t walfirst = log_.first();
+        if (state_)
+            walfirst = std::min(walfirst, state_->durable_logno());
+        wal_->set_first(walfirst);
+    }
+}
+
+
+// Snapshots
+
+/** @brief Apply committed entries to @a state.
+
+    Call before the replica joins a group, after attach_wal() if there is
+    a WAL. The replica then applies each entry to @a state once it
+    commits. Every @a snapshot_interval applied entries it takes a
+    snapshot and discards the log below it, even if other replicas lack
+    those entries. A replica missing entries the primary has discarded
+    receives the primary's snapshot in chunks of
+    Vrconstants::snapshot_chunk bytes, installs it, and then receives the
+    log from the snapshot on. With a WAL, the state resumes from its
+    durable_logno(), and recovered entries below that are dropped. */
+void Vrreplica::set_state(Vrstate* state, unsigned snapshot_interval) {
+    assert(!state_ && state && snapshot_interval > 0);
+    state_ = state;
+    snapshot_interval_ = snapshot_interval;
+    if (wal_) {
+        // entries below durable_logno() are applied, so committed; the
+        // state may cover entries the WAL had not synced
+        lognumber_t durable = state_->durable_logno();
+        assert(durable >= log_.first());
+        truncate_to_snapshot(durable);
+        appliedno_ = snapshotno_ = durable;
+        decideno_ = std::max(decideno_, durable);
+        commitno_ = std::max(commitno_, durable);
+        storeno_ = std::max(storeno_, durable);
+        sstoreno_ = std::max(sstoreno_, storeno_);
+        ackno_ = std::max(ackno_, durable);
+        sackno_ = std::max(sackno_, ackno_);
+    } else
+        appliedno_ = snapshotno_ = commitno_;
+    snapshot_ = state_->snapshot();
+}
+
+void Vrreplica::apply_committed() {
+    if (!state_)
+        return;
+    // entries below the log (awaiting a snapshot) or missing cannot apply
+    while (appliedno_ < commitno_
+           && appliedno_ >= log_.first()
+           && log_[appliedno_].is_real()) {
+        state_->apply(appliedno_, log_[appliedno_]);
+        ++appliedno_;
+    }
+    if (appliedno_ - snapshotno_
+          >= lognumber_t::difference_type(snapshot_interval_)) {
+        snapshot_ = state_->snapshot();
+        snapshotno_ = appliedno_;
+        discard_decided();
+    }
+}
+
+tamed void Vrreplica::send_snapshot(String peer_uid) {
+    tamed {
+        viewnumber_t view = cur_view_.viewno;
+        lognumber_t snapno = snapshotno_;
+        String snap = snapshot_;
+        unsigned chunk = k_.snapshot_chunk;
+        unsigned nchunks;
+        unsigned sent = 0;
+        unsigned acked = 0;
+        int tries = 0;
+        Vrchannel* ep;
+    }
+    if (snapshot_sends_.count(peer_uid))
+        return;
+    snapshot_sends_[peer_uid] = snapshot_send{snapno, 0, tamer::event<>()};
+    nchunks = std::max((snap.length() + chunk - 1) / chunk, 1U);
+    log_connection(uid(), peer_uid) << "sending snapshot l#" << snapno
+                                    << " (" << snap.length() << "B)\n";
+
+    // a window of chunks in flight; resend from the last ack on timeout
+    while (acked < nchunks && tries < 4
+           && is_primary() && in_view(view) && !stopped_) {
+        if ((ep = endpoints_[peer_uid]))
+            for (; sent < nchunks && sent < acked + k_.snapshot_window; ++sent)
+                ep->send(Json::array(m_vri_snapshot, Json::null,
+                                     view.value(), snapno.value(),
+                                     sent, nchunks,
+                                     snap.substring(sent * chunk, chunk)));
+        twait {
+            snapshot_sends_[peer_uid].wake =
+                tamer::add_timeout(k_.message_timeout, make_event());
+        }
+        if (snapshot_sends_[peer_uid].acked > acked) {
+            acked = snapshot_sends_[peer_uid].acked;
+            tries = 0;
+        } else {
+            sent = acked;
+            ++tries;
+        }
+    }
+    snapshot_sends_.erase(peer_uid);
+    // follow the installed snapshot with the log from its end
+    if (acked == nchunks && is_primary() && in_view(view) && !stopped_)
+        send_peer_encoded(peer_uid, commit_log_message(snapno, last_logno()));
+}
+
+void Vrreplica::process_snapshot(Vrchannel* who, const Json& msg) {
+    if (msg.size() < 7
+        || !msg[2].is_u()
+        || !msg[3].is_u()
+        || !msg[4].is_u()
+        || !msg[5].is_u()
+        || !msg[6].is_s()
+        || !state_) {
+        who->send(Json::array(m_vri_error, msg[1], false));
+        return;
+    } else if (msg[2].to_u() != cur_view_.viewno
+               || between_views()
+               || is_primary()) {
+        send_view(who);
+        return;
+    }
+
+    lognumber_t snapno = msg[3].to_u();
+    unsigned index = msg[4].to_u();
+    unsigned nchunks = msg[5].to_u();
+    if (snapno > appliedno_) {
+        if (index == 0) {
+            snaprecvno_ = snapno;
+            snaprecvn_ = 0;
+            snaprecv_.clear();
+        }
+        if (snapno == snaprecvno_ && index == snaprecvn_ && index < nchunks) {
+            snaprecv_ << msg[6].as_s();
+            ++snaprecvn_;
+        }
+        if (snapno == snaprecvno_ && snaprecvn_ == nchunks)
+            install_snapshot(snapno, snaprecv_.take_string());
+    }
+
+    unsigned received = 0;
+    if (snapno <= appliedno_)
+        received = nchunks;
+    else if (snapno == snaprecvno_)
+        received = snaprecvn_;
+    who->send(Json::array(m_vri_snapshot_ack, Json::null,
+                          cur_view_.viewno.value(), snapno.value(),
+                          received));
+    // once installed, tell the primary where to resume the log; with a
+    // WAL, only after the snapshot's record is durable
+    if (received == nchunks && wal_)
+        ack_after_sync(who->remote_uid(), cur_view_.viewno);
+    else if (received == nchunks)
+        who->send(Json::array(m_vri_ack, Json::null,
+                              cur_view_.viewno.value(),
+                              ackno_.value(), sackno_ - ackno_));
+    primary_received_at_ = tamer::drecent();
+}
+
+// Keep only the entries a snapshot through @a snapno does not cover.
+void Vrreplica::truncate_to_snapshot(lognumber_t snapno) {
+    if (log_.last() <= snapno) {
+        log_.clear();
+        log_.set_first(snapno);
+    } else
+        while (log_.first() < snapno)
+            log_.pop_front();
+    // the WAL drops the covered segments once the record is synced
+    if (wal_) {
+        wal_->snapshot(snapno);
+        wal_wake_();
+    }
+}
+
+void Vrreplica::install_snapshot(lognumber_t snapno, String snapshot) {
+    log_connection(uid(), cur_view_.primary().uid)
+        << "installing snapshot l#" << snapno
+        << " (" << snapshot.length() << "B)\n";
+    state_->install(snapno, snapshot);
+    appliedno_ = snapshotno_ = snapno;
+    snapshot_ = std::move(snapshot);
+    snaprecv_.clear();
+    snaprecvn_ = 0;
+
+    truncate_to_snapshot(snapno);
+
+    // the snapshot's entries are committed and, by install(), durable;
+    // with a WAL, ack_after_sync() acknowledges them after the sync
+    commitno_ = std::max(commitno_, snapno);
+    storeno_ = std::max(storeno_, snapno);
+    sstoreno_ = std::max(sstoreno_, storeno_);
+    if (!wal_) {
+        ackno_ = std::max(ackno_, snapno);
+        sackno_ = std::max(sackno_, ackno_);
+    }
+    process_at_number(last_logno(), at_store_);
+    process_at_number(commitno_, at_commit_);
+    apply_committed();
+}
+
+void Vrreplica::process_snapshot_ack(Vrchannel* who, const Json& msg) {
+    if (msg.size() < 5
+        || !msg[2].is_u()
+        || !msg[3].is_u()
+        || !msg[4].is_u()) {
+        who->send(Json::array(m_vri_error, msg[1], false));
+        return;
+    }
+    auto it = snapshot_sends_.find(who->remote_uid());
+    if (it != snapshot_sends_.end()
+        && msg[2].to_u() == cur_view_.viewno
+        && lognumber_t(msg[3].to_u()) == it->second.snapshotno
+        && msg[4].to_u() > it->second.acked) {
+        it->second.acked = msg[4].to_u();
+        it->second.wake();
+    }
+}
+
+
+// Write-ahead log
+
+/** @brief Keep the replica's log durable in @a wal.
+
+    Call before the replica joins a group. The entries @a wal recovered
+    become the replica's log. From then on the replica acknowledges
+    entries, to the primary or, as primary, to itself, only once a WAL
+    sync covers them. The WAL syncs once per event-loop turn, so all the
+    entries stored during a turn share one fdatasync. */
+void Vrreplica::attach_wal(Vrwal* wal, Vrwal::log_type& recovered) {
+    assert(!wal_ && log_.empty() && cur_view_.size() == 1);
+    wal_ = wal;
+    log_ = std::move(recovered);
+    decideno_ = commitno_ = log_.first();
+    // recovery fills gaps with empty items; only the entries before the
+    // first gap count as stored
+    lognumber_t storeno = log_.first();
+    while (storeno != log_.last() && log_[storeno].is_real())
+        ++storeno;
+    ackno_ = sackno_ = storeno_ = sstoreno_ = storeno;
+    wal_sync_loop();
+}
+
+void Vrreplica::wal_flush(tamer::event<> done) {
+    if (!wal_->dirty())
+        done();
+    else {
+        wal_waiters_.push_back(std::move(done));
+        wal_wake_();
+    }
+}
+
+tamed void Vrreplica::wal_sync_loop() {
+    tamed { int r; }
+    while (1) {
+        if (!wal_->dirty())
+            twait { wal_wake_ = make_event(); }
+        // let the rest of this turn's entries join the batch
+        twait { tamer::at_asap(make_event()); }
+        if ((r = wal_->sync()) < 0) {
+            // durability is lost: stop acknowledging anything
+            logger() << tamer::recent() << ":" << uid() << ": wal: "
+                     << strerror(-r) << "\n";
+            stop();
+            break;
+        }
+        while (!wal_waiters_.empty()) {
+            wal_waiters_.front()();
+            wal_waiters_.pop_front();
+        }
+    }
+}
+
+tamed void Vrreplica::ack_after_sync(String peer_uid, viewnumber_t view) {
+    tamed {
+        lognumber_t ackno = storeno_;
+        lognumber_t sackno = sstoreno_;
+        Vrchannel* ep;
+    }
+    twait { wal_flush(make_event()); }
+    if (cur_view_.viewno != view || between_views())
+        return;
+    ackno_ = std::max(ackno_, ackno);
+    sackno_ = std::max(ackno_, sackno);
+    if ((ep = endpoints_[peer_uid]))
+        ep->send(Json::array(m_vri_ack,
+                             Json::null,
+                             view.value(),
+                             ackno_.value(),
+                             sackno_ - ackno_));
+}
+
+tamed void Vrreplica::primary_ack_after_sync(viewnumber_t view,
+                                             lognumber_t logno) {
+    tamed {
+        Vrview::member_type* me;
+        lognumber_t commitno;
+        lognumber_t decideno;
+    }
+    twait { wal_flush(make_event()); }
+    if (!is_primary() || !in_view(view) || between_views()
+        || logno > last_logno())
+        return;
+    me = &cur_view_.primary();
+    if (me->has_ackno() && logno <= me->ackno())
+        return;
+    cur_view_.account_ack(me, logno);
+    storeno_ = sstoreno_ = std::max(storeno_, logno);
+    ackno_ = sackno_ = std::max(ackno_, logno);
+
+    // backups' earlier acks may now make up a quorum
+    commitno = commitno_;
+    decideno = decideno_;
+    for (auto& m : cur_view_.members)
+        if (m.has_ackno()) {
+            if (m.ackno_count() > cur_view_.f() && m.ackno() > commitno)
+                commitno = m.ackno();
+            if (m.ackno_count() == cur_view_.size() && m.ackno() > decideno)
+                decideno = m.ackno();
+        }
+    if (commitno > commitno_)
+        process_ack_update_commitno(commitno);
+    decideno_ = std::min(decideno, commitno_);
+    discard_decided();
+}
+
 tamed void Vrreplica::primary_keepalive_loop() {
     tamed { viewnumber_t view = cur_view_.viewno; }
     while (1) {
@@ -1161,6 +1688,11 @@ void Vrchannel::send(Json) {
     assert(0);
 }
 
+// Channels that carry Json rather than bytes decode the message first.
+void Vrchannel::send_encoded(String msg) {
+    send(msgpack::parse(msg));
+}
+
 void Vrchannel::receive(event<Json>) {
     assert(0);
 }
@@ -1169,6 +1701,143 @@ void Vrchannel::close() {
 }
 
 
+// Vrtcpchannel
+
+static bool lookup_host(const String& host, struct in_addr& addr) {
+    in_addr_t a = inet_addr(host.c_str());
+    if (a != INADDR_NONE) {
+        addr.s_addr = a;
+        return true;
+    }
+    struct hostent* hp = gethostbyname(host.c_str());
+    if (hp == NULL || hp->h_length != 4 || hp->h_addrtype != AF_INET)
+        return false;
+    addr = *((struct in_addr*) hp->h_addr);
+    return true;
+}
+
+Vrtcpchannel::Vrtcpchannel(String local_uid, String remote_uid,
+                           Json remote_name, tamer::fd cfd, bool compress)
+    : Vrchannel(std::move(local_uid), std::move(remote_uid)),
+      remote_name_(std::move(remote_name)) {
+    mpfd_.set_compression(compress);
+    mpfd_.initialize(cfd);
+}
+
+Json Vrtcpchannel::remote_name() const {
+    return remote_name_ ? remote_name_ : Vrchannel::remote_name();
+}
+
+void Vrtcpchannel::send(Json msg) {
+    if (mpfd_)
+        mpfd_.write(msg);
+}
+
+void Vrtcpchannel::send_encoded(String msg) {
+    if (mpfd_)
+        mpfd_.write_with([&](msgpack::unparser<StringAccum>& mu) {
+                mu.write_raw(msg);
+            });
+}
+
+void Vrtcpchannel::receive(event<Json> done) {
+    if (mpfd_)
+        mpfd_.read_request(std::move(done));
+    else
+        done(Json());
+}
+
+void Vrtcpchannel::close() {
+    mpfd_.clear();
+}
+
+Vrtcplistener::Vrtcplistener(String local_uid, String host, int port)
+    : Vrchannel(local_uid, String()), host_(std::move(host)), port_(port),
+      compress_(false) {
+    set_connection_uid(local_uid);
+    if (port_ > 0) {
+        lfd_ = tamer::tcp_listen(port_);
+        accept_loop();
+    }
+}
+
+Vrtcplistener::~Vrtcplistener() {
+    lfd_.close();
+}
+
+Json Vrtcplistener::local_name() const {
+    if (port_ > 0)
+        return Json::object("uid", local_uid(), "host", host_, "port", port_);
+    else
+        return Vrchannel::local_name();
+}
+
+tamed void Vrtcplistener::connect(String peer_uid, Json peer_name,
+                                  event<Vrchannel*> done) {
+    tvars {
+        struct in_addr addr;
+        tamer::fd cfd;
+        Vrtcpchannel* peer;
+    }
+    if (!peer_name.get("port").is_i()
+        || !lookup_host(peer_name.get("host").is_s()
+                        ? peer_name.get("host").to_s() : String("127.0.0.1"),
+                        addr)) {
+        done(nullptr);
+        return;
+    }
+    twait {
+        tamer::tcp_connect(addr, peer_name.get("port").to_i(),
+                           make_event(cfd));
+    }
+    if (!cfd) {
+        done(nullptr);
+        return;
+    }
+    peer = new Vrtcpchannel(local_uid(), peer_uid, peer_name, cfd,
+                            compress_);
+    peer->send(local_name());
+    done(peer);
+}
+
+void Vrtcplistener::receive_connection(event<Vrchannel*> done) {
+    if (lfd_)
+        listenq_.pop_front(done);
+    else
+        done(nullptr);
+}
+
+void Vrtcplistener::close() {
+    lfd_.close();
+}
+
+tamed void Vrtcplistener::accept_loop() {
+    tvars { tamer::fd lfd = lfd_; tamer::fd cfd; }
+    while (lfd) {
+        twait { lfd.accept(make_event(cfd)); }
+        if (cfd)
+            accept_one(cfd);
+    }
+}
+
+// The first message on an accepted connection names the connecting node.
+tamed void Vrtcplistener::accept_one(tamer::fd cfd) {
+    tvars { Vrtcpchannel* peer; Json name; }
+    peer = new Vrtcpchannel(local_uid(), String(), Json(), cfd, compress_);
+    twait {
+        peer->receive(tamer::add_timeout(vrconstants.handshake_timeout,
+                                         make_event(name)));
+    }
+    if (name.is_o() && name.get("uid").is_s() && name.get("uid").to_s()
+        && name.get("uid").to_s() != local_uid()) {
+        peer->remote_uid_ = name.get("uid").to_s();
+        peer->remote_name_ = name;
+        listenq_.push_back(peer);
+    } else
+        delete peer;
+}
+
+
 // Vrtestchannel
 
 class Vrtestchannel;
@@ -1530,6 +2199,15 @@ void Vrtestcollection::check() {
     Vrlog<unsigned, lognumber_t::value_type>
         commit_counts(first_logno, last_logno, 0);
 
+    // every batch holds 1 to batch_max() entries, and each has its
+    // commit latency recorded at most once
+    for (auto r : replicas_) {
+        const latency_histogram& sizes = r->batch_sizes();
+        assert(!sizes.count()
+               || (sizes.min() >= 1 && sizes.max() <= r->batch_max()));
+        assert(r->commit_latency().count() <= sizes.count());
+    }
+
     // check integrity of log
     for (auto r : replicas_) {
         assert(commitno_ >= r->commitno());
@@ -1646,15 +2324,296 @@ tamed void go(Vrtestcollection& vrg, std::vector<Vrreplica*>& nodes) {
     nodes[4]->go();
 
     twait { tamer::at_delay_sec(50000, make_event()); }
-    exit(0);
+
+    // the primaries measured the batches they committed
+    for (unsigned i = 0; i < nodes.size(); ++i)
+        if (nodes[i]->commit_latency().count()) {
+            std::cout << nodes[i]->status() << std::endl;
+            exit(0);
+        }
+    std::cerr << "no batch commit latency recorded\n";
+    exit(1);
+}
+
+
+// TCP mode: one replica process per node, each listening on its own
+// localhost port, plus a client in the parent process.
+
+static Json tcp_node_name(unsigned i, int base_port) {
+    return Json::object("uid", "n" + String(i),
+                        "host", "127.0.0.1",
+                        "port", base_port + int(i));
+}
+
+tamed void tcp_join(Vrreplica* r, Json peer_name, double delay) {
+    twait { tamer::at_delay(delay, make_event()); }
+    twait { r->join(peer_name["uid"].to_s(), peer_name, make_event()); }
+    r->dump(std::cout);
+}
+
+// The state machine of mpvr's TCP mode: a count and running hash of the
+// requests applied. Given a directory, it keeps its latest snapshot there,
+// written before snapshot() or install() returns, so it can resume from
+// the file alongside a WAL.
+class Vrdigest : public Vrstate {
+  public:
+    Vrdigest(String dir = String())
+        : dir_(std::move(dir)), count_(0), digest_(0), applied_(0),
+          durable_(0) {
+        if (dir_)
+            load();
+    }
+    void apply(lognumber_t logno, const Vrlogitem& li) {
+        digest_ = digest_ * 1000003 ^ uint32_t(li.request.unparse().hashcode());
+        ++count_;
+        applied_ = logno + 1;
+    }
+    String snapshot() {
+        save();
+        return msgpack::unparse(Json::array(count_, digest_));
+    }
+    void install(lognumber_t logno, const String& snapshot) {
+        Json j = msgpack::parse(snapshot);
+        count_ = j[0].to_u64();
+        digest_ = j[1].to_u64();
+        applied_ = logno;
+        save();
+    }
+    lognumber_t durable_logno() const {
+        return durable_;
+    }
+  private:
+    String dir_;
+    uint64_t count_;
+    uint64_t digest_;
+    lognumber_t applied_;
+    lognumber_t durable_;
+
+    void load();
+    void save();
+};
+
+void Vrdigest::load() {
+    std::ifstream f((dir_ + "/digest").c_str(), std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(f)),
+                     std::istreambuf_iterator<char>());
+    Json j = msgpack::parse(String(data.data(), data.length()));
+    if (j.is_a() && j.size() == 3 && j[0].is_u()) {
+        applied_ = durable_ = j[0].to_u64();
+        count_ = j[1].to_u64();
+        digest_ = j[2].to_u64();
+    }
+}
+
+// Replace the file through a synced temporary, so a crash leaves either
+// the old snapshot or the new one. Without durability the replica cannot
+// continue.
+void Vrdigest::save() {
+    if (!dir_ || applied_ == durable_)
+        return;
+    String data = msgpack::unparse(Json::array(applied_.value(),
+                                               count_, digest_));
+    String path = dir_ + "/digest", tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    int dirfd = -1;
+    if (fd < 0
+        || write(fd, data.data(), data.length()) != ssize_t(data.length())
+        || fdatasync(fd) != 0
+        || close(fd) != 0
+        || rename(tmp.c_str(), path.c_str()) != 0
+        || (dirfd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+        || fsync(dirfd) != 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    close(dirfd);
+    durable_ = applied_;
+}
+
+struct Vrtcpoptions {
+    int base_port;
+    unsigned seed;
+    String wal_dir;
+    unsigned snapshot_interval;
+    double batch_interval;
+    unsigned batch_size;
+    unsigned clients;
+    bool compress;
+};
+
+tamed void tcp_status_loop(Vrreplica* r) {
+    while (1) {
+        twait { tamer::at_delay(5, make_event()); }
+        if (r->current_view().me_primary() && r->batch_sizes().count())
+            std::cout << r->status() << std::endl;
+    }
+}
+
+static void run_tcp_replica(unsigned i, const Vrtcpoptions& opt) {
+    std::mt19937 rg(opt.seed + i);
+    Json name = tcp_node_name(i, opt.base_port);
+    Vrwal wal;
+    Vrwal::log_type recovered;
+    String dir;
+    if (opt.wal_dir) {
+        dir = opt.wal_dir + "/" + name["uid"].to_s();
+        if (int r = wal.open(dir, recovered)) {
+            std::cerr << dir << ": " << strerror(-r) << std::endl;
+            exit(1);
+        }
+    }
+    tamer::initialize();
+    Vrtcplistener* me = new Vrtcplistener(name["uid"].to_s(),
+                                          name["host"].to_s(),
+                                          name["port"].to_i());
+    me->set_compression(opt.compress);
+    if (!me->listening()) {
+        std::cerr << name["uid"].to_s() << ": listen on port "
+                  << name["port"].to_i() << ": " << strerror(-me->error())
+                  << std::endl;
+        exit(1);
+    }
+    Vrdigest* digest = nullptr;
+    if (opt.snapshot_interval) {
+        digest = new Vrdigest(dir);
+        // a WAL written without --snapshot may have discarded entries
+        // the digest never saw
+        if (wal.valid() && digest->durable_logno() < recovered.first()) {
+            std::cerr << dir << ": digest is older than the WAL\n";
+            exit(1);
+        }
+    }
+    Vrreplica* r = new Vrreplica(me->local_uid(), me, rg);
+    if (wal.valid())
+        r->attach_wal(&wal, recovered);
+    if (digest)
+        r->set_state(digest, opt.snapshot_interval);
+    r->set_batching(opt.batch_interval, opt.batch_size);
+    // join one at a time, each through node 0
+    if (i)
+        tcp_join(r, tcp_node_name(0, opt.base_port), 0.5 * i);
+    tcp_status_loop(r);
+    tamer::loop();
+    tamer::cleanup();
+}
+
+// A closed-loop client: one request outstanding at all times.
+tamed void busy_requests(Vrclient* client) {
+    tamed { int n = 1; }
+    while (1) {
+        twait { client->request("req" + String(n), make_event()); }
+        ++n;
+    }
+}
+
+tamed void tcp_client(unsigned n, const Vrtcpoptions& opt,
+                      std::mt19937& rg) {
+    tamed {
+        std::vector<Vrclient*> clients;
+        Vrtcplistener* me;
+        unsigned i;
+    }
+    twait { tamer::at_delay(0.5 * n + 1, make_event()); }
+    for (i = 0; i != std::max(opt.clients, 1U); ++i) {
+        me = new Vrtcplistener(Vrchannel::make_client_uid(), String(), 0);
+        me->set_compression(opt.compress);
+        clients.push_back(new Vrclient(me, rg));
+    }
+    twait {
+        for (i = 0; i != clients.size(); ++i)
+            clients[i]->connect("n0", tcp_node_name(0, opt.base_port),
+                                make_event());
+    }
+    if (!opt.clients)
+        many_requests(clients[0]);
+    else
+        for (i = 0; i != clients.size(); ++i)
+            busy_requests(clients[i]);
+}
+
+static std::vector<pid_t> replica_pids;
+
+static void kill_replicas(int signo) {
+    for (pid_t p : replica_pids)
+        kill(p, signo);
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+static void run_tcp(unsigned n, const Vrtcpoptions& opt) {
+    for (unsigned i = 0; i != n; ++i) {
+        pid_t p = fork();
+        if (p == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            run_tcp_replica(i, opt);
+            exit(0);
+        } else if (p < 0) {
+            std::cerr << "fork: " << strerror(errno) << std::endl;
+            kill_replicas(SIGTERM);
+        }
+        replica_pids.push_back(p);
+    }
+
+    signal(SIGINT, kill_replicas);
+    signal(SIGTERM, kill_replicas);
+    std::mt19937 rg(opt.seed);
+    tamer::initialize();
+    tcp_client(n, opt, rg);
+    tamer::loop();
+    tamer::cleanup();
+}
+
+// Group commit benchmark: store `batch` entries per sync, as one event-loop
+// turn of a busy replica would, and report durable commits per second.
+static void wal_benchmark(const String& dir) {
+    Json request = Json::array("put", "k", String(std::string(100, 'v')));
+    for (unsigned batch = 1; batch <= 256; batch *= 2) {
+        String d = dir + "/bench-" + String(batch);
+        Vrwal wal;
+        Vrwal::log_type log;
+        if (int r = wal.open(d, log)) {
+            std::cerr << d << ": " << strerror(-r) << std::endl;
+            exit(1);
+        }
+        lognumber_t logno = log.last();
+        unsigned n = std::max(batch * 64, 2048U);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (unsigned i = 0; i < n; i += batch) {
+            for (unsigned j = 0; j != batch; ++j, ++logno)
+                wal.append(logno, Vrlogitem(1, "c0", i + j, request));
+            if (int r = wal.sync()) {
+                std::cerr << d << ": " << strerror(-r) << std::endl;
+                exit(1);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        std::cout << "batch " << batch << ": "
+                  << (unsigned long) (n / t) << " commits/s, "
+                  << (unsigned long) (wal.syncs() / t) << " syncs/s, sync p50 "
+                  << wal.sync_latency().percentile(0.5) / 1000 << "us p99 "
+                  << wal.sync_latency().percentile(0.99) / 1000 << "us"
+                  << std::endl;
+    }
 }
 
 static Clp_Option options[] = {
+    { "batch-interval", 0, 0, Clp_ValDouble, 0 },
+    { "batch-size", 0, 0, Clp_ValUnsigned, 0 },
+    { "clients", 'c', 0, Clp_ValUnsigned, 0 },
+    { "compress", 0, 0, 0, Clp_Negate },
     { "f", 'f', 0, Clp_ValUnsigned, 0 },
     { "loss", 'l', 0, Clp_ValDouble, 0 },
     { "n", 'n', 0, Clp_ValUnsigned, 0 },
+    { "port", 'p', 0, Clp_ValInt, 0 },
     { "quiet", 'q', 0, 0, Clp_Negate },
-    { "seed", 's', 0, Clp_ValUnsigned, 0 }
+    { "seed", 's', 0, Clp_ValUnsigned, 0 },
+    { "snapshot", 0, 0, Clp_ValUnsigned, 0 },
+    { "tcp", 0, 0, 0, 0 },
+    { "wal", 0, 0, Clp_ValString, 0 },
+    { "wal-bench", 0, 0, Clp_ValString, 0 }
 };
 
 int main(int argc, char** argv) {
@@ -1662,6 +2621,9 @@ int main(int argc, char** argv) {
     unsigned n = 0;
     unsigned seed = std::mt19937::default_seed;
     double loss_p = 0.1;
+    bool tcp = false;
+    Vrtcpoptions tcpopt = {19100, 0, String(), 0, 0, 256, 0, false};
+    String bench_dir;
     while (Clp_Next(clp) != Clp_Done) {
         if (Clp_IsLong(clp, "seed"))
             seed = clp->val.u;
@@ -1674,7 +2636,27 @@ int main(int argc, char** argv) {
         } else if (Clp_IsLong(clp, "loss")) {
             assert(clp->val.d >= 0 && clp->val.d <= 1);
             loss_p = clp->val.d;
-        } else if (Clp_IsLong(clp, "quiet")) {
+        } else if (Clp_IsLong(clp, "tcp"))
+            tcp = true;
+        else if (Clp_IsLong(clp, "port"))
+            tcpopt.base_port = clp->val.i;
+        else if (Clp_IsLong(clp, "wal"))
+            tcpopt.wal_dir = clp->vstr;
+        else if (Clp_IsLong(clp, "wal-bench"))
+            bench_dir = clp->vstr;
+        else if (Clp_IsLong(clp, "snapshot"))
+            tcpopt.snapshot_interval = clp->val.u;
+        else if (Clp_IsLong(clp, "batch-interval")) {
+            assert(clp->val.d >= 0);
+            tcpopt.batch_interval = clp->val.d;
+        } else if (Clp_IsLong(clp, "batch-size")) {
+            assert(clp->val.u > 0);
+            tcpopt.batch_size = clp->val.u;
+        } else if (Clp_IsLong(clp, "clients"))
+            tcpopt.clients = clp->val.u;
+        else if (Clp_IsLong(clp, "compress"))
+            tcpopt.compress = !clp->negated;
+        else if (Clp_IsLong(clp, "quiet")) {
             if (clp->negated)
                 logger.set_frequency(0);
             else
@@ -1683,6 +2665,15 @@ int main(int argc, char** argv) {
     }
     n = n ? n : 5;
 
+    if (bench_dir) {
+        wal_benchmark(bench_dir);
+        return 0;
+    } else if (tcp) {
+        tcpopt.seed = seed;
+        run_tcp(n, tcpopt);
+        return 0;
+    }
+
     tamer::set_time_type(tamer::time_virtual);
     tamer::initialize();
 
@@ -16,15 +16,17 @@ const uint8_t nbytes[] = {
 };
 }
 
-const uint8_t* streaming_parser::consume(const uint8_t* first,
-                                         const uint8_t* last,
-                                         const String& str) {
+const uint8_t* streaming_parser::consume_elements(const uint8_t* first,
+                                                  const uint8_t* last,
+                                                  const String& str) {
     using std::swap;
     Json* jx;
+    const uint8_t* start = first;
     int n = 0;
 
     if (state_ < 0)
         return first;
+    Json::arena::scope arena_scope(arena_);
     if (state_ == st_partial || state_ == st_string) {
         int nneed;
         if (state_ == st_partial)
@@ -44,10 +46,11 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             stack_.pop_back();
             jx = stack_.empty() ? &json_ : stack_.back().jp;
             *jx = str_;
+            copied_bytes_ += str_.length();
             goto next;
         } else {
             state_ = st_normal;
-            consume(str_.ubegin(), str_.uend(), str_);
+            consume_elements(str_.ubegin(), str_.uend(), str_);
             if (state_ != st_normal)
                 return next;
         }
@@ -69,6 +72,9 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             n = *first - format::ffixmap;
             ++first;
         map:
+            if (uint32_t(n) > room(start, first) / 2
+                || stack_.size() >= size_t(max_depth_))
+                goto error;
             if (jx->is_o())
                 jx->clear();
             else
@@ -77,6 +83,9 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             n = *first - format::ffixarray;
             ++first;
         array:
+            if (uint32_t(n) > room(start, first)
+                || stack_.size() >= size_t(max_depth_))
+                goto error;
             if (!jx->is_a())
                 *jx = Json::make_array_reserve(n);
             jx->resize(n);
@@ -84,17 +93,21 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             n = *first - format::ffixstr;
             ++first;
         raw:
+            if (n < 0 || size_t(n) > room(start, first))
+                goto error;
             if (last - first < n) {
                 str_ = String(first, last);
                 stack_.push_back(selem{0, n});
                 state_ = st_string;
                 return last;
             }
-            if (first < str.ubegin() || first + n >= str.uend())
+            if (first < str.ubegin() || first + n > str.uend()) {
                 *jx = String(first, n);
-            else {
+                copied_bytes_ += n;
+            } else {
                 const char* s = reinterpret_cast<const char*>(first);
                 *jx = str.fast_substring(s, s + n);
+                aliased_bytes_ += n;
             }
             first += n;
         } else {
@@ -206,6 +219,191 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
     return first;
 }
 
+/** @brief Return the encoded length of the element starting at @a first.
+
+    Returns 0 if [@a first, @a last) holds only a prefix of the element,
+    and -1 if the element is malformed or uses unsupported types. When 0
+    is returned and @a want is nonnull, *@a want is set to a lower bound
+    on the element's length. */
+ssize_t element_length(const uint8_t* first, const uint8_t* last,
+                       size_t* want) {
+    const uint8_t* s = first;
+    size_t remaining = 1;
+    size_t need;
+
+    while (remaining != 0) {
+        size_t hlen = 1, plen = 0, nchild = 0;
+        if (s == last)
+            goto incomplete;
+        if (format::is_fixint(*s) || *s == format::fnull
+            || format::is_bool(*s))
+            /* nothing */;
+        else if (format::is_fixmap(*s))
+            nchild = 2 * (*s - format::ffixmap);
+        else if (format::is_fixarray(*s))
+            nchild = *s - format::ffixarray;
+        else if (format::is_fixstr(*s))
+            plen = *s - format::ffixstr;
+        else {
+            uint8_t type = *s - format::fnull;
+            if (!nbytes[type])
+                return -1;
+            hlen = nbytes[type];
+            if ((size_t) (last - s) < hlen) {
+                need = hlen;
+                goto incomplete;
+            }
+            switch (*s) {
+            case format::fbin8:
+            case format::fstr8:
+                plen = s[1];
+                break;
+            case format::fbin16:
+            case format::fstr16:
+                plen = read_in_net_order<uint16_t>(s + 1);
+                break;
+            case format::fbin32:
+            case format::fstr32:
+                plen = read_in_net_order<uint32_t>(s + 1);
+                break;
+            case format::farray16:
+                nchild = read_in_net_order<uint16_t>(s + 1);
+                break;
+            case format::farray32:
+                nchild = read_in_net_order<uint32_t>(s + 1);
+                break;
+            case format::fmap16:
+                nchild = 2 * (size_t) read_in_net_order<uint16_t>(s + 1);
+                break;
+            case format::fmap32:
+                nchild = 2 * (size_t) read_in_net_order<uint32_t>(s + 1);
+                break;
+            }
+        }
+        if ((size_t) (last - s) < hlen + plen) {
+            need = hlen + plen;
+            goto incomplete;
+        }
+        s += hlen + plen;
+        remaining += nchild - 1;
+    }
+    return s - first;
+
+ incomplete:
+    if (s == last)
+        need = 1;
+    if (want)
+        *want = (s - first) + need + (remaining - 1);
+    return 0;
+}
+
+/** @brief Return the nesting depth of the complete element at @a first.
+
+    Scalars have depth 0, and an array or map has depth one more than its
+    deepest member. Returns -1 if [@a first, @a last) does not hold a
+    complete, well-formed element. */
+int element_depth(const uint8_t* first, const uint8_t* last) {
+    local_vector<size_t, 16> remaining;
+    const uint8_t* s = first;
+    int depth = 0;
+
+    do {
+        size_t nchild;
+        if (s == last)
+            return -1;
+        if (format::is_fixmap(*s)) {
+            nchild = 2 * (*s - format::ffixmap);
+            ++s;
+        } else if (format::is_fixarray(*s)) {
+            nchild = *s - format::ffixarray;
+            ++s;
+        } else if (*s >= format::farray16 && *s <= format::fmap32) {
+            int hlen = nbytes[*s - format::fnull];
+            if (last - s < hlen)
+                return -1;
+            if (hlen == 3)
+                nchild = read_in_net_order<uint16_t>(s + 1);
+            else
+                nchild = read_in_net_order<uint32_t>(s + 1);
+            if (*s >= format::fmap16)
+                nchild *= 2;
+            s += hlen;
+        } else {
+            ssize_t len = element_length(s, last);
+            if (len <= 0)
+                return -1;
+            s += len;
+            goto leaf;
+        }
+
+        if (int(remaining.size()) + 1 > depth)
+            depth = remaining.size() + 1;
+        if (nchild != 0) {
+            remaining.push_back(nchild);
+            continue;
+        }
+    leaf:
+        while (!remaining.empty() && --remaining.back() == 0)
+            remaining.pop_back();
+    } while (!remaining.empty());
+    return depth;
+}
+
+/** @brief Find a string or binary payload that ends the array at @a first.
+
+    If [@a first, @a last) holds the header of an array, all but the last
+    of its members, and the header of a final str or bin member, sets
+    *@a hlen and *@a plen to that member's header and payload lengths and
+    returns its offset from @a first. Otherwise returns -1. The payload
+    itself need not be present. */
+ssize_t trailing_payload(const uint8_t* first, const uint8_t* last,
+                         size_t* hlen, size_t* plen) {
+    const uint8_t* s = first;
+    size_t n;
+    if (s == last)
+        return -1;
+    if (format::is_fixarray(*s)) {
+        n = *s - format::ffixarray;
+        ++s;
+    } else if ((*s == format::farray16 && last - s >= 3)
+               || (*s == format::farray32 && last - s >= 5)) {
+        n = *s == format::farray16 ? read_in_net_order<uint16_t>(s + 1)
+            : read_in_net_order<uint32_t>(s + 1);
+        s += nbytes[*s - format::fnull];
+    } else
+        return -1;
+    if (n == 0)
+        return -1;
+
+    for (; n != 1; --n) {
+        ssize_t len = element_length(s, last);
+        if (len <= 0)
+            return -1;
+        s += len;
+    }
+
+    if (s == last)
+        return -1;
+    if (format::is_fixstr(*s)) {
+        *hlen = 1;
+        *plen = *s - format::ffixstr;
+    } else if (*s == format::fbin8 || *s == format::fstr8
+               || *s == format::fbin16 || *s == format::fstr16
+               || *s == format::fbin32 || *s == format::fstr32) {
+        *hlen = nbytes[*s - format::fnull];
+        if ((size_t) (last - s) < *hlen)
+            return -1;
+        if (*hlen == 2)
+            *plen = s[1];
+        else if (*hlen == 3)
+            *plen = read_in_net_order<uint16_t>(s + 1);
+        else
+            *plen = read_in_net_order<uint32_t>(s + 1);
+    } else
+        return -1;
+    return s - first;
+}
+
 parser& parser::operator>>(Str& x) {
     uint32_t len;
     if ((uint32_t) *s_ - format::ffixstr < format::nfixstr) {
@@ -237,4 +435,123 @@ parser& parser::operator>>(String& x) {
     return *this;
 }
 
+
+view::view(const String& str)
+    : s_(0), str_(str) {
+    if (element_length(str.ubegin(), str.uend()) > 0)
+        s_ = str.ubegin();
+}
+
+const uint8_t* view::body(int& n) const {
+    unsigned size;
+    parser p(s_);
+    if (is_a())
+        p.read_array_header(size);
+    else
+        p.read_map_header(size);
+    n = size;
+    return reinterpret_cast<const uint8_t*>(p.position());
+}
+
+int view::size() const {
+    int n = 0;
+    if (is_a() || is_o())
+        body(n);
+    return n;
+}
+
+view view::operator[](int i) const {
+    int n;
+    if (!is_a() || i < 0)
+        return view();
+    const uint8_t* s = body(n);
+    if (i >= n)
+        return view();
+    for (; i != 0; --i)
+        s = skip(s);
+    return view(s, str_);
+}
+
+view view::get(Str key) const {
+    int n;
+    if (!is_o())
+        return view();
+    const uint8_t* s = body(n);
+    for (; n != 0; --n) {
+        view k(s, str_);
+        s = skip(s);
+        if (k.is_s() && k.as_str() == key)
+            return view(s, str_);
+        s = skip(s);
+    }
+    return view();
+}
+
+int64_t view::as_i() const {
+    if (is_d())
+        return (int64_t) as_d();
+    assert(is_i());
+    int64_t x = 0;
+    parser(s_).read_int(x);
+    return x;
+}
+
+uint64_t view::as_u() const {
+    if (is_d())
+        return (uint64_t) as_d();
+    assert(is_i());
+    uint64_t x = 0;
+    parser(s_).read_int(x);
+    return x;
+}
+
+double view::as_d() const {
+    if (s_ && *s_ == format::ffloat32)
+        return read_in_net_order<float>(s_ + 1);
+    else if (s_ && *s_ == format::ffloat64)
+        return read_in_net_order<double>(s_ + 1);
+    else if (s_ && *s_ == format::fuint64)
+        return as_u();
+    else
+        return as_i();
+}
+
+Str view::as_str() const {
+    assert(is_s());
+    Str x;
+    parser(s_) >> x;
+    return x;
+}
+
+String view::as_s() const {
+    Str x = as_str();
+    return str_.substring(x.begin(), x.end());
+}
+
+String view::raw() const {
+    if (!s_)
+        return String();
+    const char* first = reinterpret_cast<const char*>(s_);
+    return str_.substring(first, reinterpret_cast<const char*>(skip(s_)));
+}
+
+Json view::to_json() const {
+    if (!s_ || *s_ == format::fnull)
+        return Json();
+    else if (format::is_fixint(*s_))
+        return Json(int(int8_t(*s_)));
+    else if (is_b())
+        return Json(as_b());
+    else if (*s_ == format::fuint64)
+        return Json(as_u());
+    else if (is_i())
+        return Json(as_i());
+    else if (is_d())
+        return Json(as_d());
+    else if (is_s())
+        return Json(as_s());
+    else
+        return parse(raw());
+}
+
 } // namespace msgpack
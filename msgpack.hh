@@ -222,6 +222,8 @@ inline object_t object(uint32_t size) {
     return object_t(size);
 }
 
+class view;
+
 template <typename T>
 class unparser {
   public:
@@ -324,10 +326,16 @@ class unparser {
         return *this;
     }
     unparser<T>& operator<<(const Json& j);
+    inline unparser<T>& operator<<(const view& v);
     template <typename X>
     inline unparser<T>& write(const X& x) {
         return *this << x;
     }
+    /** @brief Append @a x, which must already be msgpack-encoded. */
+    inline unparser<T>& write_raw(Str x) {
+        base_.append(x.data(), x.length());
+        return *this;
+    }
 
   private:
     T& base_;
@@ -343,12 +351,21 @@ class streaming_parser {
     inline bool success() const;
     inline bool error() const;
 
+    inline size_t copied_bytes() const;
+    inline size_t aliased_bytes() const;
+    inline Json::arena* arena() const;
+    inline void set_arena(Json::arena* a);
+    inline size_t max_size() const;
+    inline void set_max_size(size_t max_size);
+    inline int max_depth() const;
+    inline void set_max_depth(int max_depth);
+
     inline size_t consume(const char* first, size_t length,
                           const String& str = String());
     inline const char* consume(const char* first, const char* last,
                                const String& str = String());
-    const uint8_t* consume(const uint8_t* first, const uint8_t* last,
-                           const String& str = String());
+    inline const uint8_t* consume(const uint8_t* first, const uint8_t* last,
+                                  const String& str = String());
 
     inline Json& result();
     inline const Json& result() const;
@@ -363,10 +380,20 @@ class streaming_parser {
         int size;
     };
     int state_;
+    size_t copied_bytes_;
+    size_t aliased_bytes_;
+    size_t consumed_;
+    size_t max_size_;
+    int max_depth_;
+    Json::arena* arena_;
     local_vector<selem, 2> stack_;
     String str_;
     Json json_;
     Json jokey_;
+
+    const uint8_t* consume_elements(const uint8_t* first, const uint8_t* last,
+                                    const String& str);
+    inline size_t room(const uint8_t* start, const uint8_t* first) const;
 };
 
 class parser {
@@ -456,6 +483,20 @@ class parser {
         }
         return *this;
     }
+    inline parser& read_map_header(unsigned& size) {
+        if (format::is_fixmap(*s_)) {
+            size = *s_ - format::ffixmap;
+            s_ += 1;
+        } else if (*s_ == format::fmap16) {
+            size = read_in_net_order<uint16_t>(s_ + 1);
+            s_ += 3;
+        } else {
+            assert(*s_ == format::fmap32);
+            size = read_in_net_order<uint32_t>(s_ + 1);
+            s_ += 5;
+        }
+        return *this;
+    }
     template <typename T> parser& operator>>(::std::vector<T>& x);
     inline parser& operator>>(Json& j);
 
@@ -501,6 +542,232 @@ class parser {
     template <typename T> void hard_read_int(T& x);
 };
 
+ssize_t element_length(const uint8_t* first, const uint8_t* last,
+                       size_t* want = 0);
+int element_depth(const uint8_t* first, const uint8_t* last);
+ssize_t trailing_payload(const uint8_t* first, const uint8_t* last,
+                         size_t* hlen, size_t* plen);
+
+/** @class view
+    @brief Read-only view of an encoded msgpack element.
+
+    A view examines encoded bytes on demand without building a Json.
+    Array elements and map values are themselves views. A view holds a
+    reference to the String containing its bytes, so string values can
+    be returned as substrings. */
+class view {
+  public:
+    typedef bool (view::*unspecified_bool_type)() const;
+    class const_array_iterator;
+    class const_object_iterator;
+
+    inline view();
+    explicit view(const String& str);
+    inline view(const uint8_t* s, const String& str);
+
+    inline bool valid() const;
+    inline operator unspecified_bool_type() const;
+    inline bool operator!() const;
+
+    inline bool is_null() const;
+    inline bool is_b() const;
+    inline bool is_i() const;
+    inline bool is_d() const;
+    inline bool is_number() const;
+    inline bool is_s() const;
+    inline bool is_a() const;
+    inline bool is_o() const;
+
+    int size() const;
+    view operator[](int i) const;
+    view get(Str key) const;
+    inline view operator[](Str key) const;
+    inline view operator[](const char* key) const;
+
+    inline bool as_b() const;
+    int64_t as_i() const;
+    uint64_t as_u() const;
+    double as_d() const;
+    Str as_str() const;
+    String as_s() const;
+
+    String raw() const;
+    Json to_json() const;
+    inline String unparse() const;
+
+    inline const_array_iterator cabegin() const;
+    inline const_array_iterator caend() const;
+    inline const_object_iterator cobegin() const;
+    inline const_object_iterator coend() const;
+
+  private:
+    const uint8_t* s_;
+    String str_;
+
+    inline const uint8_t* skip(const uint8_t* s) const;
+    const uint8_t* body(int& n) const;
+};
+
+class view::const_array_iterator {
+  public:
+    inline view operator*() const {
+        return view(s_, str_);
+    }
+    inline const_array_iterator& operator++() {
+        s_ = s_ + element_length(s_, str_.uend());
+        --n_;
+        return *this;
+    }
+    inline bool operator==(const const_array_iterator& x) const {
+        return n_ == x.n_;
+    }
+    inline bool operator!=(const const_array_iterator& x) const {
+        return n_ != x.n_;
+    }
+  private:
+    const uint8_t* s_;
+    int n_;
+    String str_;
+    inline const_array_iterator(const uint8_t* s, int n, const String& str)
+        : s_(s), n_(n), str_(str) {
+    }
+    friend class view;
+};
+
+class view::const_object_iterator {
+  public:
+    inline view key() const {
+        return view(s_, str_);
+    }
+    inline view value() const {
+        return view(s_ + element_length(s_, str_.uend()), str_);
+    }
+    inline const_object_iterator& operator++() {
+        s_ = s_ + element_length(s_, str_.uend());
+        s_ = s_ + element_length(s_, str_.uend());
+        --n_;
+        return *this;
+    }
+    inline bool operator==(const const_object_iterator& x) const {
+        return n_ == x.n_;
+    }
+    inline bool operator!=(const const_object_iterator& x) const {
+        return n_ != x.n_;
+    }
+  private:
+    const uint8_t* s_;
+    int n_;
+    String str_;
+    inline const_object_iterator(const uint8_t* s, int n, const String& str)
+        : s_(s), n_(n), str_(str) {
+    }
+    friend class view;
+};
+
+inline view::view()
+    : s_(0) {
+}
+
+/** @brief Construct a view of the element starting at @a s.
+    @pre @a s points at a complete, well-formed element within @a str. */
+inline view::view(const uint8_t* s, const String& str)
+    : s_(s), str_(str) {
+}
+
+inline bool view::valid() const {
+    return s_;
+}
+
+inline view::operator unspecified_bool_type() const {
+    return !is_null() ? &view::valid : 0;
+}
+
+inline bool view::operator!() const {
+    return is_null();
+}
+
+inline bool view::is_null() const {
+    return !s_ || *s_ == format::fnull;
+}
+
+inline bool view::is_b() const {
+    return s_ && format::is_bool(*s_);
+}
+
+inline bool view::is_i() const {
+    return s_ && (format::is_fixint(*s_)
+                  || format::in_range(*s_, format::fuint8, 8));
+}
+
+inline bool view::is_d() const {
+    return s_ && (*s_ == format::ffloat32 || *s_ == format::ffloat64);
+}
+
+inline bool view::is_number() const {
+    return is_i() || is_d();
+}
+
+inline bool view::is_s() const {
+    return s_ && (format::is_fixstr(*s_)
+                  || format::in_range(*s_, format::fbin8, 3)
+                  || format::in_range(*s_, format::fstr8, 3));
+}
+
+inline bool view::is_a() const {
+    return s_ && (format::is_fixarray(*s_) || *s_ == format::farray16
+                  || *s_ == format::farray32);
+}
+
+inline bool view::is_o() const {
+    return s_ && (format::is_fixmap(*s_) || *s_ == format::fmap16
+                  || *s_ == format::fmap32);
+}
+
+inline view view::operator[](Str key) const {
+    return get(key);
+}
+
+inline view view::operator[](const char* key) const {
+    return get(Str(key));
+}
+
+inline bool view::as_b() const {
+    assert(is_b());
+    return *s_ - format::ffalse;
+}
+
+inline String view::unparse() const {
+    return to_json().unparse();
+}
+
+inline auto view::cabegin() const -> const_array_iterator {
+    int n = 0;
+    const uint8_t* s = is_a() ? body(n) : 0;
+    return const_array_iterator(s, n, str_);
+}
+
+inline auto view::caend() const -> const_array_iterator {
+    return const_array_iterator(0, 0, String());
+}
+
+inline auto view::cobegin() const -> const_object_iterator {
+    int n = 0;
+    const uint8_t* s = is_o() ? body(n) : 0;
+    return const_object_iterator(s, n, str_);
+}
+
+inline auto view::coend() const -> const_object_iterator {
+    return const_object_iterator(0, 0, String());
+}
+
+inline const uint8_t* view::skip(const uint8_t* s) const {
+    return s + element_length(s, str_.uend());
+}
+
+inline std::ostream& operator<<(std::ostream& f, const view& v) {
+    return f << v.to_json();
+}
+
 template <typename T>
 void parser::hard_read_int(T& x) {
     switch (*s_) {
@@ -575,6 +842,16 @@ unparser<T>& unparser<T>::operator<<(const Json& j) {
     return *this;
 }
 
+template <typename T>
+inline unparser<T>& unparser<T>::operator<<(const view& v) {
+    if (v.valid()) {
+        String raw = v.raw();
+        base_.append(raw.data(), raw.length());
+    } else
+        base_.append(char(format::fnull));
+    return *this;
+}
+
 inline String unparse(const Json& j) {
     StringAccum sa;
     unparser<StringAccum>(sa, j);
@@ -613,11 +890,13 @@ parser& parser::operator>>(::std::vector<T>& x) {
 }
 
 inline streaming_parser::streaming_parser()
-    : state_(st_normal) {
+    : state_(st_normal), copied_bytes_(0), aliased_bytes_(0), consumed_(0),
+      max_size_(size_t(-1)), max_depth_(INT_MAX), arena_() {
 }
 
 inline void streaming_parser::reset() {
     state_ = st_normal;
+    consumed_ = 0;
     stack_.clear();
 }
 
@@ -637,6 +916,66 @@ inline bool streaming_parser::error() const {
     return state_ == st_error;
 }
 
+inline size_t streaming_parser::copied_bytes() const {
+    return copied_bytes_;
+}
+
+inline size_t streaming_parser::aliased_bytes() const {
+    return aliased_bytes_;
+}
+
+/** @brief Return the arena that parsed arrays and objects are built in.
+
+    When set, consume() allocates array and object storage from the arena,
+    so a parsed result can be torn down without per-node frees. */
+inline Json::arena* streaming_parser::arena() const {
+    return arena_;
+}
+
+inline void streaming_parser::set_arena(Json::arena* a) {
+    arena_ = a;
+}
+
+inline size_t streaming_parser::max_size() const {
+    return max_size_;
+}
+
+/** @brief Fail elements longer than @a max_size bytes.
+
+    The parser checks each string's and container's declared length
+    against the bytes left under the limit before buffering or allocating
+    anything for it, so a peer cannot make it reserve more memory than
+    the limit allows. The limit covers everything consumed since the
+    last reset(). */
+inline void streaming_parser::set_max_size(size_t max_size) {
+    max_size_ = max_size;
+}
+
+inline int streaming_parser::max_depth() const {
+    return max_depth_;
+}
+
+/** @brief Fail elements with arrays and maps nested more than
+    @a max_depth deep. */
+inline void streaming_parser::set_max_depth(int max_depth) {
+    max_depth_ = max_depth;
+}
+
+// Bytes left under max_size_ once [start, first) has been consumed.
+inline size_t streaming_parser::room(const uint8_t* start,
+                                     const uint8_t* first) const {
+    size_t used = consumed_ + (first - start);
+    return used < max_size_ ? max_size_ - used : 0;
+}
+
+inline const uint8_t* streaming_parser::consume(const uint8_t* first,
+                                                const uint8_t* last,
+                                                const String& str) {
+    const uint8_t* next = consume_elements(first, last, str);
+    consumed_ += next - first;
+    return next;
+}
+
 inline const char* streaming_parser::consume(const char* first,
                                              const char* last,
                                              const String& str) {
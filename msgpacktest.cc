@@ -1,4 +1,12 @@
 #include "msgpack.hh"
+#include "mpcompress.hh"
+#include "vrwal.hh"
+#include "mpshm.hh"
+#include "histogram.hh"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 enum { status_ok, status_error, status_incomplete };
 
@@ -57,6 +65,41 @@ static void test(const char* file, int line,
 
 #define TEST(...) test(__FILE__, __LINE__, ## __VA_ARGS__)
 
+static void check_syscall(const char* file, int line, int r,
+                          const char* what) {
+    if (r < 0) {
+        std::cerr << file << ":" << line << ": " << what << ": "
+                  << strerror(r == -1 ? errno : -r) << "\n";
+        exit(1);
+    }
+}
+
+#define CHECK_SYSCALL(r, what) check_syscall(__FILE__, __LINE__, (r), (what))
+
+static String make_wal_dir() {
+    char dir[] = "/tmp/msgpacktest-wal-XXXXXX";
+    CHECK_SYSCALL(mkdtemp(dir) ? 0 : -1, "mkdtemp");
+    return String(dir);
+}
+
+static String last_wal_segment(const String& dir) {
+    DIR* d = opendir(dir.c_str());
+    CHECK_SYSCALL(d ? 0 : -1, "opendir");
+    String last;
+    while (struct dirent* de = readdir(d))
+        if (de->d_name[0] != '.' && (!last || last < String(de->d_name)))
+            last = de->d_name;
+    closedir(d);
+    return last ? dir + "/" + last : String();
+}
+
+static void remove_wal_dir(const String& dir) {
+    String seg;
+    while ((seg = last_wal_segment(dir)))
+        CHECK_SYSCALL(unlink(seg.c_str()), "unlink");
+    CHECK_SYSCALL(rmdir(dir.c_str()), "rmdir");
+}
+
 void check_correctness() {
     TEST("\0", 1, 1, "0");
     TEST("\xFF  ", 3, 1, "-1");
@@ -124,6 +167,309 @@ void check_correctness() {
              "[9223372036854775808,-9223372036854775808]");
     }
 
+    {
+        // strings split across consume() calls are copied; strings
+        // inside the passed buffer alias it
+        String buf("\x93\x01\xA5" "hello\xD9\x05" "world", 15);
+        msgpack::streaming_parser a;
+        size_t pos = a.consume(buf.data(), 5, buf);
+        assert(pos == 5 && !a.done());
+        pos += a.consume(buf.data() + pos, 10, buf);
+        assert(pos == 15 && a.success());
+        assert(a.result().unparse() == "[1,\"hello\",\"world\"]");
+        assert(a.result()[2].as_s().data() == buf.data() + 10);
+        assert(a.aliased_bytes() == 5 && a.copied_bytes() == 5);
+    }
+
+    {
+        // arena-backed parsing
+        Json::arena arena;
+        msgpack::streaming_parser a;
+        a.set_arena(&arena);
+        String buf("\x92\x81\xA1" "a\x01\x91\x02", 8);
+        Json s0 = Json::allocation_stats();
+        a.consume(buf.begin(), buf.end(), buf);
+        Json s1 = Json::allocation_stats();
+        assert(a.success() && a.result().unparse() == "[{\"a\":1},[2]]");
+        assert(s1["arena_allocations"].to_i() - s0["arena_allocations"].to_i() >= 3);
+    }
+
+    {
+        String m = msgpack::unparse(Json::array(1, -20000, "hello",
+                                                Json::object("a", 2.5, "bb", Json::array(true, Json::null)),
+                                                (uint64_t) 1 << 63));
+        msgpack::view v(m);
+        assert(v && v.is_a() && v.size() == 5);
+        assert(v[0].is_i() && v[0].as_i() == 1);
+        assert(v[1].as_i() == -20000);
+        assert(v[2].is_s() && v[2].as_s() == "hello");
+        assert(v[2].as_s().data() == m.data() + 6);
+        assert(v[3].is_o() && v[3].size() == 2);
+        assert(v[3]["a"].is_d() && v[3]["a"].as_d() == 2.5);
+        assert(v[3]["bb"][0].as_b() && v[3]["bb"][1].is_null());
+        assert(!v[3]["c"].valid() && !v[5].valid());
+        assert(v[4].as_u() == (uint64_t) 1 << 63);
+        assert(v[3].unparse() == "{\"a\":2.5,\"bb\":[true,null]}");
+        assert(v.unparse() == msgpack::parse(m).unparse());
+        int n = 0;
+        for (auto it = v.cabegin(); it != v.caend(); ++it, ++n)
+            assert((*it).raw() == msgpack::unparse(msgpack::parse(m)[n]));
+        assert(n == 5);
+        n = 0;
+        for (auto it = v[3].cobegin(); it != v[3].coend(); ++it, ++n)
+            assert(it.key().as_s() == (n ? "bb" : "a"));
+        assert(n == 2);
+
+        StringAccum sa;
+        msgpack::unparser<StringAccum>(sa) << msgpack::array(2) << v[3]["bb"] << v[2];
+        assert(msgpack::parse(sa.take_string()).unparse() == "[[true,null],\"hello\"]");
+
+        // already-encoded elements splice into a message
+        String part = msgpack::unparse(Json(1)) + msgpack::unparse(Json("x"));
+        msgpack::unparser<StringAccum>(sa) << msgpack::array(3) << 0;
+        msgpack::unparser<StringAccum>(sa).write_raw(part);
+        assert(msgpack::parse(sa.take_string()).unparse() == "[0,1,\"x\"]");
+
+        size_t want = 0;
+        assert(msgpack::element_length(m.ubegin(), m.uend()) == m.length());
+        assert(msgpack::element_length(m.ubegin(), m.ubegin() + 4, &want) == 0
+               && want >= 8);
+        assert(!msgpack::view(m.substring(0, m.length() - 1)).valid());
+        assert(msgpack::element_length((const uint8_t*) "\xC1", (const uint8_t*) "\xC1" + 1) == -1);
+    }
+
+    {
+        // size and depth limits fail before buffering
+        String big("\x92\x01\xDB\x7F\xFF\xFF\xFF" "abc", 10);
+        msgpack::streaming_parser a;
+        a.set_max_size(1 << 20);
+        a.consume(big.begin(), big.end(), big);
+        assert(a.error());
+        String arr("\xDD\x10\x00\x00\x00\x01", 6);
+        a.reset();
+        a.consume(arr.begin(), arr.end(), arr);
+        assert(a.error());
+        String ok = msgpack::unparse(Json::array(1, "hello", Json::array(2)));
+        a.reset();
+        a.consume(ok.begin(), ok.end(), ok);
+        assert(a.success());
+        a.reset();
+        a.set_max_depth(1);
+        a.consume(ok.begin(), ok.end(), ok);
+        assert(a.error());
+
+        String deep = msgpack::unparse(Json::array(1, Json::object("a", Json::array()), Json::array(2)));
+        assert(msgpack::element_depth(ok.ubegin(), ok.uend()) == 2);
+        assert(msgpack::element_depth(deep.ubegin(), deep.uend()) == 3);
+        assert(msgpack::element_depth(deep.ubegin(), deep.uend() - 1) == -1);
+        assert(msgpack::element_depth((const uint8_t*) "\x01", (const uint8_t*) "\x01" + 1) == 0);
+
+        // trailing payloads
+        String m = msgpack::unparse(Json::array(2, 5, String(std::string(300, 'x'))));
+        size_t hlen = 0, plen = 0;
+        assert(msgpack::trailing_payload(m.ubegin(), m.ubegin() + 6, &hlen, &plen) == 3
+               && hlen == 3 && plen == 300);
+        assert(msgpack::trailing_payload(m.ubegin(), m.ubegin() + 4, &hlen, &plen) == -1);
+        assert(msgpack::trailing_payload(ok.ubegin(), ok.uend(), &hlen, &plen) == -1);
+    }
+
+    {
+        // block compression round trip
+        StringAccum sa;
+        for (int i = 0; i != 1000; ++i)
+            sa << msgpack::unparse(Json::array(-1, i, Json::object("client_uid", 1000 + i % 50, "op", "put")));
+        sa << "abcab";
+        String m = sa.take_string();
+        String z = String::make_uninitialized(mpcompress::bound(m.length()));
+        size_t zlen = mpcompress::compress(m.data(), m.length(), z.mutable_data());
+        assert(zlen < size_t(m.length()) / 2);
+        String r = String::make_uninitialized(m.length());
+        assert(mpcompress::decompress(z.data(), zlen, r.mutable_data(), r.length()) == m.length());
+        assert(r == m);
+        assert(mpcompress::decompress(z.data(), zlen, r.mutable_data(), r.length() - 1) == -1);
+        assert(mpcompress::compress("abc", 3, z.mutable_data()) == 4
+               && mpcompress::decompress(z.data(), 4, r.mutable_data(), 3) == 3
+               && memcmp(r.data(), "abc", 3) == 0);
+    }
+
+    {
+        // latency histogram buckets, percentiles, and merge
+        latency_histogram h;
+        assert(h.count() == 0 && h.percentile(0.5) == 0 && h.mean() == 0);
+        for (uint64_t v = 0; v != 64; ++v)
+            h.record(v);
+        assert(h.count() == 64 && h.min() == 0 && h.max() == 63);
+        assert(h.mean() == 31.5);
+        assert(h.percentile(0) == 0 && h.percentile(0.5) == 31
+               && h.percentile(1) == 63);
+
+        // a value's bucket bound is at most 1/32 above it
+        const uint64_t big = uint64_t(1) << 50;
+        for (uint64_t v = 64; v < (uint64_t(1) << 40); v += v / 7 + 1) {
+            h.clear();
+            h.record(v);
+            h.record(big);
+            uint64_t p = h.percentile(0.5);
+            assert(p >= v && p - v <= v / 32);
+            (void) p;
+        }
+        // values in the top bucket report the recorded maximum
+        h.clear();
+        h.record(uint64_t(1) << 41);
+        h.record(big);
+        assert(h.percentile(0.5) == big && h.percentile(1) == big);
+
+        latency_histogram a, b, all;
+        for (uint64_t v = 1; v <= 1000; ++v) {
+            (v % 3 ? a : b).record(v * 1000);
+            all.record(v * 1000);
+        }
+        a.merge(latency_histogram());
+        a.merge(b);
+        assert(a.count() == 1000 && a.min() == 1000 && a.max() == 1000000);
+        assert(a.mean() == all.mean());
+        for (double q = 0; q <= 1; q += 0.125)
+            assert(a.percentile(q) == all.percentile(q));
+        uint64_t p99 = a.percentile(0.99);
+        assert(p99 >= 990000 && p99 <= 990000 + 990000 / 32);
+        (void) p99;
+    }
+
+    if (shm_channel* a = shm_channel::create(4096)) {
+        // shared-memory channel: round trip, full ring, end of file
+        int fds[shm_channel::nfds];
+        for (int i = 0; i != shm_channel::nfds; ++i)
+            fds[i] = dup(a->fds()[i]);
+        // a wait descriptor that is not an eventfd is refused
+        int pfd[2];
+        CHECK_SYSCALL(pipe(pfd), "pipe");
+        std::swap(fds[1], pfd[0]);
+        assert(!shm_channel::attach(fds) && errno == EINVAL);
+        std::swap(fds[1], pfd[0]);
+        close(pfd[0]);
+        close(pfd[1]);
+        shm_channel* b = shm_channel::attach(fds);
+        assert(b && b->capacity() == 4096);
+        char buf[8192];
+        memset(buf, 'x', sizeof(buf));
+        struct iovec iov[2] = {{(void*) "hello, ", 7}, {(void*) "world", 5}};
+        ssize_t r = a->writev(iov, 2);
+        assert(r == 12);
+        r = b->read(buf, sizeof(buf));
+        assert(r == 12 && memcmp(buf, "hello, world", 12) == 0);
+        r = b->read(buf, sizeof(buf));
+        assert(r == -1 && errno == EAGAIN);
+
+        iov[0].iov_base = buf;
+        iov[0].iov_len = sizeof(buf);
+        r = a->writev(iov, 1);
+        assert(r == 4096);
+        r = a->writev(iov, 1);
+        assert(r == -1 && errno == EAGAIN);
+        r = b->read(buf, 1000);
+        assert(r == 1000);
+        r = a->writev(iov, 1);
+        assert(r == 1000);
+
+        // the peer reads what was written, then end of file
+        delete a;
+        size_t total = 0;
+        while ((r = b->read(buf, sizeof(buf))) > 0)
+            total += r;
+        assert(r == 0 && total == 4096);
+        r = b->writev(iov, 1);
+        assert(r == -1 && errno == EPIPE);
+        delete b;
+    } else
+        assert(errno == ENOSYS);
+
+    {
+        // write-ahead log recovery
+        String dir = make_wal_dir();
+        Vrwal::log_type log, rlog;
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, log), "Vrwal::open");
+            assert(log.empty());
+            wal.set_segment_size(64);
+            for (unsigned i = 0; i != 10; ++i) {
+                wal.append(i, Vrlogitem(1, "c", i, Json::array("req", i)));
+                if (i % 3 == 2)
+                    CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+            }
+            wal.truncate(8);
+            wal.append(8, Vrlogitem(2, "d", 1, "x"));
+            assert(wal.dirty());
+            CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+            assert(!wal.dirty());
+            assert(wal.records() == 12 && wal.status()["segments"].to_i() > 1);
+        }
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, rlog), "Vrwal::open");
+            assert(rlog.first().value() == 0 && rlog.last().value() == 9);
+            assert(rlog[3] == Vrlogitem(1, "c", 3, Json::array("req", 3)));
+            assert(rlog[8] == Vrlogitem(2, "d", 1, "x"));
+            wal.append(9, Vrlogitem(2, "d", 2, "y"));
+            CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+            // old segments go once the log's new start is durable
+            wal.set_first(9);
+            assert(wal.status()["segments"].to_i() > 1);
+            CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+            assert(wal.status()["segments"].to_i() == 1);
+        }
+        // a torn record at the tail is cut off
+        String last = last_wal_segment(dir);
+        int fd = open(last.c_str(), O_WRONLY | O_APPEND);
+        CHECK_SYSCALL(fd, "open");
+        CHECK_SYSCALL(write(fd, "\x95\x0A\x02", 3) == 3 ? 0 : -1, "write");
+        close(fd);
+        {
+            Vrwal wal;
+            rlog = Vrwal::log_type();
+            CHECK_SYSCALL(wal.open(dir, rlog), "Vrwal::open");
+            assert(rlog.first().value() == 9 && rlog.last().value() == 10
+                   && rlog[9] == Vrlogitem(2, "d", 2, "y"));
+        }
+        rlog = Vrwal::log_type();
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, rlog), "Vrwal::open");
+            assert(rlog.last().value() == 10);
+            // a snapshot drops the entries below it
+            wal.snapshot(9);
+            CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+        }
+        rlog = Vrwal::log_type();
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, rlog), "Vrwal::open");
+            assert(rlog.first().value() == 9 && rlog.last().value() == 10
+                   && rlog[9] == Vrlogitem(2, "d", 2, "y"));
+        }
+        remove_wal_dir(dir);
+    }
+
+    {
+        // an entry stored into a gap does not move the log's start
+        String dir = make_wal_dir();
+        Vrwal::log_type log, rlog;
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, log), "Vrwal::open");
+            wal.append(5, Vrlogitem(1, "c", 5, "x"));
+            CHECK_SYSCALL(wal.sync(), "Vrwal::sync");
+        }
+        {
+            Vrwal wal;
+            CHECK_SYSCALL(wal.open(dir, rlog), "Vrwal::open");
+            assert(rlog.first().value() == 0 && rlog.last().value() == 6);
+            assert(!rlog[0].is_real() && !rlog[4].is_real()
+                   && rlog[5].is_real());
+        }
+        remove_wal_dir(dir);
+    }
+
     std::cout << "All tests pass!\n";
 }
 
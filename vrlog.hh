@@ -15,6 +15,10 @@ struct Vrlogitem {
     String client_uid;
     unsigned client_seqno;
     Json request;
+    // msgpack encoding of the entry as a commit message carries it in
+    // view encoded_view; stale once the view changes
+    mutable String encoded;
+    mutable viewnumber_t encoded_view;
 
     Vrlogitem() {
     }
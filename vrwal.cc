@@ -0,0 +1,320 @@
+#include "vrwal.hh"
+#include "msgpack.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+namespace {
+enum { default_segment_size = 64 << 20 };
+
+inline uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int read_file(const String& path, String& data) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    StringAccum sa;
+    ssize_t amt;
+    while (1) {
+        char* buf = sa.reserve(65536);
+        amt = ::read(fd, buf, 65536);
+        if (amt > 0)
+            sa.adjust_length(amt);
+        else if (amt == 0 || errno != EINTR)
+            break;
+    }
+    int err = amt < 0 ? -errno : 0;
+    ::close(fd);
+    data = sa.take_string();
+    return err;
+}
+}
+
+Vrwal::Vrwal()
+    : fd_(-1), dirfd_(-1), segsize_(default_segment_size), segpos_(0),
+      first_(0), recfirst_(0), bufrecords_(0), bufentries_(false),
+      nsyncs_(0), nrecords_(0), nbytes_(0) {
+}
+
+Vrwal::~Vrwal() {
+    close();
+}
+
+String Vrwal::segment_path(uint64_t seqno) const {
+    char buf[32];
+    sprintf(buf, "/wal.%016llx", (unsigned long long) seqno);
+    return dir_ + buf;
+}
+
+void Vrwal::note_entry(bool& has_entries, lognumber_t& last,
+                       lognumber_t logno) {
+    if (!has_entries || last <= logno) {
+        has_entries = true;
+        last = logno + 1;
+    }
+}
+
+/** @brief Open the log in directory @a dir, creating it if necessary.
+
+    Replays the existing segments into @a log, which should be empty. A
+    torn record at the end of the last segment, left by a crash during
+    sync(), is cut off. Returns 0 on success or a negative errno; -EIO
+    means a segment other than the last is corrupt. */
+int Vrwal::open(const String& dir, log_type& log) {
+    close();
+    dir_ = dir;
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -errno;
+    if ((dirfd_ = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    DIR* d = fdopendir(dup(dirfd_));
+    if (!d)
+        return -errno;
+    while (struct dirent* de = readdir(d)) {
+        char* end;
+        if (strncmp(de->d_name, "wal.", 4) == 0 && strlen(de->d_name) == 20) {
+            uint64_t seqno = strtoull(de->d_name + 4, &end, 16);
+            if (*end == 0)
+                segments_.push_back(segment{seqno, false, 0});
+        }
+    }
+    closedir(d);
+    std::sort(segments_.begin(), segments_.end(),
+              [](const segment& a, const segment& b) {
+                  return a.seqno < b.seqno;
+              });
+
+    for (size_t i = 0; i != segments_.size(); ++i)
+        if (int r = recover_segment(segments_[i], log,
+                                    i + 1 == segments_.size()))
+            return r;
+    first_ = recfirst_ = log.first();
+
+    if (segments_.empty() || segpos_ >= segsize_)
+        return start_segment();
+    fd_ = ::open(segment_path(segments_.back().seqno).c_str(),
+                 O_WRONLY | O_APPEND | O_CLOEXEC);
+    return fd_ < 0 ? -errno : 0;
+}
+
+int Vrwal::recover_segment(segment& seg, log_type& log, bool is_last) {
+    String path = segment_path(seg.seqno), data;
+    if (int r = read_file(path, data))
+        return r;
+
+    msgpack::streaming_parser parser;
+    parser.set_max_size(data.length());
+    const char* s = data.begin();
+    while (s != data.end()) {
+        parser.reset();
+        const char* next = parser.consume(s, data.end(), data);
+        const Json& j = parser.result();
+        if (!parser.success() || !j.is_a() || !j[0].is_u())
+            break;
+        lognumber_t logno = j[0].to_u();
+        if (j.size() == 1) {
+            if (logno <= log.first()) {
+                log.clear();
+                log.set_first(logno);
+            } else if (logno < log.last())
+                log.resize(logno - log.first());
+        } else if (j.size() == 2 && j[1].is_bool()) {
+            if (logno >= log.last()) {
+                log.clear();
+                log.set_first(logno);
+            } else
+                while (log.first() < logno)
+                    log.pop_front();
+        } else if (j.size() == 5 && j[1].is_u() && j[2].is_s()
+                   && j[3].is_u()) {
+            Vrlogitem li(j[1].to_u(), j[2].to_s(), j[3].to_u(), j[4]);
+            if (logno >= log.first()) {
+                while (log.last() < logno)
+                    log.push_back(Vrlogitem());
+                if (logno == log.last())
+                    log.push_back(std::move(li));
+                else
+                    log[logno] = std::move(li);
+            }
+            note_entry(seg.has_entries, seg.last, logno);
+        } else
+            break;
+        s = next;
+    }
+
+    segpos_ = s - data.begin();
+    if (s != data.end()) {
+        if (!is_last)
+            return -EIO;
+        if (::truncate(path.c_str(), segpos_) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+int Vrwal::start_segment() {
+    uint64_t seqno = segments_.empty() ? 1 : segments_.back().seqno + 1;
+    int fd = ::open(segment_path(seqno).c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -errno;
+    // the new file's directory entry must be durable too; its start
+    // record becomes durable with the next sync()
+    StringAccum sa;
+    msgpack::unparser<StringAccum>(sa)
+        << msgpack::array(2) << first_.value() << Json(true);
+    if (fsync(dirfd_) < 0
+        || ::write(fd, sa.data(), sa.length()) != ssize_t(sa.length())) {
+        int err = errno ? -errno : -EIO;
+        ::close(fd);
+        ::unlink(segment_path(seqno).c_str());
+        return err;
+    }
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = fd;
+    segpos_ = sa.length();
+    segments_.push_back(segment{seqno, false, 0});
+    recfirst_ = std::max(recfirst_, first_);
+    return 0;
+}
+
+// Delete the oldest segments once a start record shows they hold no
+// entry the log still needs. The current segment is always kept.
+void Vrwal::discard_segments() {
+    while (segments_.size() > 1) {
+        segment& seg = segments_.front();
+        if (seg.has_entries && recfirst_ < seg.last)
+            break;
+        ::unlink(segment_path(seg.seqno).c_str());
+        segments_.erase(segments_.begin());
+    }
+}
+
+void Vrwal::close() {
+    if (fd_ >= 0)
+        ::close(fd_);
+    if (dirfd_ >= 0)
+        ::close(dirfd_);
+    fd_ = dirfd_ = -1;
+    segments_.clear();
+    buf_.clear();
+    bufrecords_ = 0;
+    bufentries_ = false;
+}
+
+/** @brief Buffer a record storing @a li at @a logno. */
+void Vrwal::append(lognumber_t logno, const Vrlogitem& li) {
+    msgpack::unparser<StringAccum>(buf_)
+        << msgpack::array(5) << logno.value() << li.viewno.value()
+        << li.client_uid << li.client_seqno << li.request;
+    ++bufrecords_;
+    note_entry(bufentries_, buflast_, logno);
+}
+
+/** @brief Buffer a record dropping the entries at @a last and above. */
+void Vrwal::truncate(lognumber_t last) {
+    msgpack::unparser<StringAccum>(buf_)
+        << msgpack::array(1) << last.value();
+    ++bufrecords_;
+}
+
+/** @brief Buffer a record dropping the entries below @a first.
+
+    Used after installing a snapshot that covers them. Unlike set_first(),
+    this always writes a record, even if no segment can be deleted. */
+void Vrwal::snapshot(lognumber_t first) {
+    msgpack::unparser<StringAccum>(buf_)
+        << msgpack::array(2) << first.value() << Json(true);
+    ++bufrecords_;
+    first_ = std::max(first_, first);
+    recfirst_ = std::max(recfirst_, first);
+}
+
+/** @brief Note that entries below @a first are no longer needed.
+
+    If that frees the oldest segments, buffers a start record at @a first;
+    the next sync() deletes them once the record is durable. The current
+    segment is always kept. */
+void Vrwal::set_first(lognumber_t first) {
+    if (first <= first_)
+        return;
+    first_ = first;
+    if (segments_.size() > 1
+        && (!segments_.front().has_entries
+            || segments_.front().last <= first)) {
+        msgpack::unparser<StringAccum>(buf_)
+            << msgpack::array(2) << first.value() << Json(true);
+        ++bufrecords_;
+        recfirst_ = first;
+    }
+}
+
+/** @brief Write and fdatasync every buffered record.
+
+    Returns 0 once the records are durable, or a negative errno. After an
+    error the log's tail is unknown; stop using it and recover with
+    open(). */
+int Vrwal::sync() {
+    if (!dirty())
+        return 0;
+    if (fd_ < 0)
+        return -EBADF;
+    uint64_t t0 = clock_ns();
+    if (segpos_ >= segsize_)
+        if (int r = start_segment())
+            return r;
+
+    const char* s = buf_.data();
+    size_t left = buf_.length();
+    while (left) {
+        ssize_t amt = ::write(fd_, s, left);
+        if (amt < 0 && errno != EINTR)
+            return -errno;
+        else if (amt > 0) {
+            s += amt;
+            left -= amt;
+        }
+    }
+    if (fdatasync(fd_) < 0)
+        return -errno;
+
+    if (bufentries_)
+        note_entry(segments_.back().has_entries, segments_.back().last,
+                   buflast_ - 1);
+    segpos_ += buf_.length();
+    nbytes_ += buf_.length();
+    nrecords_ += bufrecords_;
+    ++nsyncs_;
+    buf_.clear();
+    bufrecords_ = 0;
+    bufentries_ = false;
+    discard_segments();
+    sync_latency_.record(clock_ns() - t0);
+    return 0;
+}
+
+Json Vrwal::status() const {
+    Json j = Json().set("dir", dir_)
+        .set("segments", segments_.size())
+        .set("syncs", nsyncs_)
+        .set("records", nrecords_)
+        .set("bytes", nbytes_);
+    if (nsyncs_)
+        j.set("records_per_sync", double(nrecords_) / nsyncs_)
+            .set("sync_p50_us", sync_latency_.percentile(0.5) / 1000.0)
+            .set("sync_p99_us", sync_latency_.percentile(0.99) / 1000.0);
+    return j;
+}
@@ -0,0 +1,121 @@
+// -*- mode: c++ -*-
+#ifndef VRWAL_HH
+#define VRWAL_HH 1
+#include "vrlog.hh"
+#include "straccum.hh"
+#include "histogram.hh"
+#include <vector>
+
+/** @class Vrwal
+    @brief A write-ahead log of Vrlogitems in segment files.
+
+    append() and truncate() only buffer records. sync() writes everything
+    buffered with one write and makes it durable with one fdatasync, so a
+    caller that syncs once per event-loop turn gets group commit: all the
+    changes made during the turn share one disk flush.
+
+    Records are msgpack arrays. [logno, viewno, client_uid, client_seqno,
+    request] stores an entry at logno, replacing any entry there; [logno]
+    drops the entries at logno and above; [logno, true] starts the log at
+    logno, dropping the entries below it. Recovery starts the log at 0
+    unless a start record says otherwise, and fills gaps between entries
+    with empty items. Segment files are named wal.SEQNO in the log's
+    directory, and each begins with a start record. sync() starts a new
+    segment once the current one passes segment_size() bytes, and deletes
+    the oldest segments once a durable start record shows they hold only
+    entries below the log's first entry. */
+class Vrwal {
+  public:
+    typedef Vrlog<Vrlogitem, lognumber_t::value_type> log_type;
+
+    Vrwal();
+    ~Vrwal();
+
+    int open(const String& dir, log_type& log);
+    void close();
+    inline bool valid() const;
+
+    inline size_t segment_size() const;
+    inline void set_segment_size(size_t size);
+
+    void append(lognumber_t logno, const Vrlogitem& li);
+    void truncate(lognumber_t last);
+    void snapshot(lognumber_t first);
+    void set_first(lognumber_t first);
+
+    inline bool dirty() const;
+    int sync();
+
+    inline size_t syncs() const;
+    inline size_t records() const;
+    inline const latency_histogram& sync_latency() const;
+    Json status() const;
+
+  private:
+    struct segment {
+        uint64_t seqno;
+        bool has_entries;
+        lognumber_t last;       // one past the highest entry
+    };
+
+    String dir_;
+    int fd_;
+    int dirfd_;
+    size_t segsize_;
+    size_t segpos_;
+    std::vector<segment> segments_;
+    lognumber_t first_;
+    lognumber_t recfirst_;      // highest start written to a record
+
+    StringAccum buf_;
+    size_t bufrecords_;
+    bool bufentries_;
+    lognumber_t buflast_;
+
+    size_t nsyncs_;
+    size_t nrecords_;
+    size_t nbytes_;
+    latency_histogram sync_latency_;
+
+    Vrwal(const Vrwal&) = delete;
+    Vrwal& operator=(const Vrwal&) = delete;
+
+    String segment_path(uint64_t seqno) const;
+    int recover_segment(segment& seg, log_type& log, bool is_last);
+    int start_segment();
+    void discard_segments();
+    static void note_entry(bool& has_entries, lognumber_t& last,
+                           lognumber_t logno);
+};
+
+inline bool Vrwal::valid() const {
+    return fd_ >= 0;
+}
+
+inline size_t Vrwal::segment_size() const {
+    return segsize_;
+}
+
+inline void Vrwal::set_segment_size(size_t size) {
+    segsize_ = size;
+}
+
+/** @brief Return true iff some records are buffered but not yet synced. */
+inline bool Vrwal::dirty() const {
+    return buf_.length() != 0;
+}
+
+inline size_t Vrwal::syncs() const {
+    return nsyncs_;
+}
+
+inline size_t Vrwal::records() const {
+    return nrecords_;
+}
+
+/** @brief Return the time each sync() took, in nanoseconds. */
+inline const latency_histogram& Vrwal::sync_latency() const {
+    return sync_latency_;
+}
+
+#endif